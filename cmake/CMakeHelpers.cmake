@@ -237,6 +237,9 @@ function(cc_test)
 
   add_test(NAME ${_NAME} COMMAND ${_NAME})
   set_tests_properties(${_NAME} PROPERTIES FAIL_REGULAR_EXPRESSION ".*FAILED.*")
+  if(SANITIZER_TEST_ENV)
+    set_tests_properties(${_NAME} PROPERTIES ENVIRONMENT "${SANITIZER_TEST_ENV}")
+  endif()
 endfunction()
 
 # cmake-format: off
@@ -36,6 +36,10 @@ function(enable_sanitizers TARGET)
         )
       else()
         list(APPEND SANITIZERS "thread")
+        # Tests run with suppressions for interceptors called from TBB
+        set(SANITIZER_TEST_ENV
+            "TSAN_OPTIONS=suppressions=${PROJECT_SOURCE_DIR}/cmake/tsan.supp halt_on_error=1"
+            PARENT_SCOPE)
       endif()
     endif()
 
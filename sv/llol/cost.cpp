@@ -3,6 +3,9 @@
 #include <glog/logging.h>
 #include <tbb/parallel_for.h>
 
+#include <algorithm>  // nth_element, sort
+#include <numeric>    // iota
+
 namespace sv {
 
 using SO3d = Sophus::SO3d;
@@ -12,6 +15,8 @@ using Matrix3d = Eigen::Matrix3d;
 using MatrixXd = Eigen::MatrixXd;
 using RowMatXd = NllsSolver::RowMat;
 using Vector9d = Eigen::Matrix<double, 9, 1>;
+using Matrix6d = Eigen::Matrix<double, 6, 6>;
+using Matrix36d = Eigen::Matrix<double, 3, 6>;
 using Matrix9d = Eigen::Matrix<double, 9, 9>;
 
 GicpCost::GicpCost(int num_params, double w_imu, int gsize)
@@ -44,14 +49,8 @@ void GicpCost::UpdateMatches(const SweepGrid& grid) {
   // Collect all good matches
   pgrid = &grid;
 
-  matches.clear();
-  matches.reserve(grid.total() / 2);
-  for (int r = 0; r < grid.rows(); ++r) {
-    for (int c = 0; c < grid.cols(); ++c) {
-      const auto& match = grid.MatchAt({c, r});
-      if (match.Ok()) matches.push_back(match);
-    }
-  }
+  // Only indices are collected, matches are read from grid by index
+  grid.matches.GetValid(matches);
 
   // Precompute pt_p_hat
   // This seems to make stuff slower
@@ -59,11 +58,66 @@ void GicpCost::UpdateMatches(const SweepGrid& grid) {
   tbb::parallel_for(
       tbb::blocked_range<int>(0, matches.size(), gsize_), [&](const auto& blk) {
         for (int i = blk.begin(); i < blk.end(); ++i) {
-          const auto& match = matches.at(i);
-          const auto c = match.px_g.x;
-          pts_p_hat.at(i) = (pgrid->TfAt(c) * match.mc_g.mean).cast<double>();
+          const int k = matches[i];
+          const auto c = pgrid->PoseCol(pgrid->matches.px_g[k]);
+          pts_p_hat.at(i) =
+              pgrid->TransformAt(c, pgrid->matches.mc_g[k].mean).cast<double>();
+        }
+      });
+}
+
+int GicpCost::SelectMatches(int max_matches) {
+  const int n = static_cast<int>(matches.size());
+  if (max_matches <= 0 || n <= max_matches) return n;
+
+  const auto& table = pgrid->matches;
+
+  // Jacobian of each match wrt (r0, p0) at zero error, same as in Compute()
+  std::vector<Matrix36d> Js(n);
+  tbb::parallel_for(
+      tbb::blocked_range<int>(0, n, gsize_), [&](const auto& blk) {
+        for (int i = blk.begin(); i < blk.end(); ++i) {
+          const int k = matches[i];
+          const Matrix3d U = table.U[k].cast<double>() * table.scale[k];
+          Js[i] << U * Hat3(pts_p_hat[i]), -U;
         }
       });
+
+  // Information of all matches, with a small prior to keep H invertible in a
+  // degenerate scene
+  Matrix6d H = Matrix6d::Identity() * 1e-6;
+  for (const auto& J : Js) H.noalias() += J.transpose() * J;
+  const Matrix6d H_inv = H.ldlt().solve(Matrix6d::Identity());
+
+  // Leverage of match i is tr(J H^-1 J'), its share of the information in the
+  // directions it constrains. Matches in directions that few others constrain
+  // have the highest leverage, so taking the top ones is a cheap stand-in for
+  // greedy log det selection, which needs a sequential update per pick
+  std::vector<double> leverage(n);
+  tbb::parallel_for(
+      tbb::blocked_range<int>(0, n, gsize_), [&](const auto& blk) {
+        for (int i = blk.begin(); i < blk.end(); ++i) {
+          leverage[i] = (Js[i] * H_inv).cwiseProduct(Js[i]).sum();
+        }
+      });
+
+  std::vector<int> selected(n);
+  std::iota(selected.begin(), selected.end(), 0);
+  std::nth_element(selected.begin(),
+                   selected.begin() + max_matches,
+                   selected.end(),
+                   [&](int i0, int i1) { return leverage[i0] > leverage[i1]; });
+  selected.resize(max_matches);
+
+  // Keep the original order, selected[j] >= j so this can be done in place
+  std::sort(selected.begin(), selected.end());
+  for (int j = 0; j < max_matches; ++j) {
+    matches[j] = matches[selected[j]];
+    pts_p_hat[j] = pts_p_hat[selected[j]];
+  }
+  matches.resize(max_matches);
+  pts_p_hat.resize(max_matches);
+  return max_matches;
 }
 
 bool GicpCostRigid::Compute(const double* px, double* pr, double* pJ) const {
@@ -71,22 +125,24 @@ bool GicpCostRigid::Compute(const double* px, double* pr, double* pJ) const {
   const SO3d eR = SO3d::exp(es.r0());
   const SE3d eT{eR, es.p0()};
 
+  const auto& table = pgrid->matches;
+
   tbb::parallel_for(
       tbb::blocked_range<int>(0, matches.size(), gsize_), [&](const auto& blk) {
         for (int i = blk.begin(); i < blk.end(); ++i) {
-          const auto& match = matches.at(i);
-          const Vector3d pt_p = match.mc_p.mean.cast<double>();
+          const int k = matches[i];
+          const Vector3d pt_p = table.mc_p[k].mean.cast<double>();
           const auto& pt_p_hat = pts_p_hat.at(i);
 
           const int ri = kResidualDim * i;
           Eigen::Map<Vector3d> r(pr + ri);
 
-          auto U = match.U.cast<double>().eval();
+          auto U = table.U[k].cast<double>().eval();
           r = U * (pt_p - eT * pt_p_hat);
 
           // Do a simple gating test and downweight outliers
           // https://www.itl.nist.gov/div898/handbook/eda/section3/eda3674.htm
-          double w_icp = match.scale;
+          double w_icp = table.scale[k];
           // const auto r2 = r.squaredNorm();
           // t-distribution weight from eq 22 in
           // Robust Odometry Estimation for RGB-D Cameras
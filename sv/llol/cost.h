@@ -16,6 +16,11 @@ struct GicpCost : public CostBase {
   int NumParameters() const override { return error.size(); }
 
   void UpdateMatches(const SweepGrid& grid);
+  /// @brief Keep at most max_matches matches with the highest leverage in the
+  /// information of rotation and translation, call after UpdateMatches()
+  /// @param max_matches <= 0 means keep all, which is the default in the node
+  /// @return Number of matches kept
+  int SelectMatches(int max_matches);
   void UpdatePreint(const Trajectory& traj, const ImuQueue& imuq);
 
   virtual void UpdateTraj(Trajectory& traj) const = 0;
@@ -24,7 +29,7 @@ struct GicpCost : public CostBase {
   double imu_weight{0.0};
 
   const SweepGrid* pgrid{nullptr};
-  std::vector<PointMatch> matches;
+  std::vector<int> matches;  // indices of good matches in grid
   std::vector<Eigen::Vector3d> pts_p_hat;
 
   const Trajectory* ptraj{nullptr};
@@ -3,6 +3,8 @@
 #include <benchmark/benchmark.h>
 #include <gtest/gtest.h>
 
+#include <random>
+
 namespace sv {
 namespace {
 
@@ -104,5 +106,120 @@ BENCHMARK(BM_CostManual);
 //}
 // BENCHMARK(BM_CostAutodiff);
 
+/// @brief Grid with all matches valid, grid points are on the walls, floor and
+/// end of a corridor along x, most of them on the walls so they constrain the
+/// same directions. Pano points are grid points moved by T_p_g with noise
+/// along the normal
+SweepGrid MakeCorridorGrid(const Sophus::SE3d& T_p_g, double noise = 0.01) {
+  SweepGrid grid({1024, 64});
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<double> uni(-1.0, 1.0);
+  std::normal_distribution<double> nrm(0.0, noise);
+
+  for (int i = 0; i < grid.total(); ++i) {
+    Eigen::Vector3d pt(10 * uni(gen), 2.0, uni(gen));
+    Eigen::Vector3d nm = Eigen::Vector3d::UnitY();
+    if (i % 16 == 0) {
+      // floor
+      pt = {10 * uni(gen), 2 * uni(gen), -1.0};
+      nm = Eigen::Vector3d::UnitZ();
+    } else if (i % 64 == 1) {
+      // end of corridor
+      pt = {10.0, 2 * uni(gen), uni(gen)};
+      nm = Eigen::Vector3d::UnitX();
+    } else if (i % 2 == 0) {
+      // the other wall
+      pt.y() = -2.0;
+    }
+
+    auto match = grid.matches.At(i);
+    match.px_g = grid.Ind2Px(i);
+    match.px_p = match.px_g;
+    match.mc_g.n = match.mc_p.n = 5;
+    match.mc_g.mean = pt.cast<float>();
+    match.mc_p.mean = (T_p_g * pt + nm * nrm(gen)).cast<float>();
+    // Points on a plane are certain along normal, so U'U = I + 99 nn'
+    match.U = (Eigen::Matrix3d::Identity() + 9.0 * nm * nm.transpose())
+                  .cast<float>();
+    match.scale = 1.0F;
+    grid.matches.SetValid(i, true);
+  }
+  return grid;
+}
+
+/// @brief Solve rigid icp with at most max_matches and return pose error, as
+/// the sum of rotation and translation error
+double SolveCorridor(const SweepGrid& grid,
+                     const Sophus::SE3d& T_p_g,
+                     int max_matches) {
+  GicpCostRigid cost(0.0);
+  cost.UpdateMatches(grid);
+  cost.SelectMatches(max_matches);
+
+  NllsSolver solver;
+  solver.options.max_num_iterations = 5;
+  solver.Solve(cost, cost.error.data());
+
+  const GicpCostRigid::State es(cost.error.data());
+  const Sophus::SE3d T{Sophus::SO3d::exp(es.r0()), es.p0()};
+  const auto dT = T.inverse() * T_p_g;
+  return dT.so3().log().norm() + dT.translation().norm();
+}
+
+const Sophus::SE3d kCorridorTf{Sophus::SO3d::exp({0.01, -0.02, 0.03}),
+                               {0.1, -0.05, 0.02}};
+
+TEST(CostTest, TestSelectMatches) {
+  const auto grid = MakeCorridorGrid(kCorridorTf);
+
+  GicpCostRigid cost(0.0);
+  cost.UpdateMatches(grid);
+  ASSERT_EQ(cost.matches.size(), grid.total());
+  const auto pts_p_hat = cost.pts_p_hat;
+
+  EXPECT_EQ(cost.SelectMatches(0), grid.total());
+  EXPECT_EQ(cost.SelectMatches(256), 256);
+  EXPECT_EQ(cost.matches.size(), 256);
+  EXPECT_EQ(cost.NumResiduals(), 256 * 3);
+  EXPECT_TRUE(std::is_sorted(cost.matches.begin(), cost.matches.end()));
+  for (int j = 0; j < cost.matches.size(); ++j) {
+    EXPECT_EQ(cost.pts_p_hat[j], pts_p_hat[cost.matches[j]]);
+  }
+
+  // The few cells at the end of corridor constrain x, so they are selected
+  int n_end = 0;
+  for (const int i : cost.matches) n_end += static_cast<int>(i % 64 == 1);
+  EXPECT_GT(n_end, 0);
+
+  // A subset gives nearly the same solution
+  const auto err_all = SolveCorridor(grid, kCorridorTf, 0);
+  const auto err_sel = SolveCorridor(grid, kCorridorTf, 256);
+  EXPECT_LT(err_all, 1e-2);
+  EXPECT_LT(err_sel, 2 * err_all + 1e-3);
+}
+
+void BM_CostSelectSolve(benchmark::State& state) {
+  const auto grid = MakeCorridorGrid(kCorridorTf);
+  const int max_matches = state.range(0);
+
+  double err = 0;
+  for (auto _ : state) {
+    err = SolveCorridor(grid, kCorridorTf, max_matches);
+    benchmark::DoNotOptimize(err);
+  }
+  state.counters["pose_err"] = err;
+}
+BENCHMARK(BM_CostSelectSolve)->Arg(0)->Arg(1024)->Arg(512)->Arg(256)->Arg(128);
+
+void BM_CostSelect(benchmark::State& state) {
+  const auto grid = MakeCorridorGrid(kCorridorTf);
+  GicpCostRigid cost(0.0);
+  for (auto _ : state) {
+    cost.UpdateMatches(grid);
+    cost.SelectMatches(state.range(0));
+  }
+}
+BENCHMARK(BM_CostSelect)->Arg(0)->Arg(1024)->Arg(256);
+
 }  // namespace
 }  // namespace sv
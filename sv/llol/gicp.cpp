@@ -16,37 +16,45 @@ GicpSolver::GicpSolver(const GicpParams& params)
       cov_lambda{params.cov_lambda},
       half_win{params.half_cols, params.half_rows},
       imu_weight{params.imu_weight},
-      min_eigval{params.min_eigval} {}
+      min_eigval{params.min_eigval},
+      max_matches{params.max_matches} {}
 
 std::string GicpSolver::Repr() const {
   return fmt::format(
-      "GicpSolver(outer={}, inner={}, cov_lambda={}, imu_weight={})",
+      "GicpSolver(outer={}, inner={}, cov_lambda={}, imu_weight={}, "
+      "max_matches={})",
       outer_iters,
       inner_iters,
       cov_lambda,
-      imu_weight);
+      imu_weight,
+      max_matches);
 }
 
 int GicpSolver::Match(SweepGrid& grid, const DepthPano& pano, int gsize) {
-  const auto rows = grid.rows();
-  gsize = gsize <= 0 ? rows : gsize;
-
-  return tbb::parallel_reduce(
-      tbb::blocked_range<int>(0, rows, gsize),
+  // Only candidate cells need matching, so we split the compact list of them
+  // instead of rows, which are badly imbalanced. gsize is still rows per task
+  // and is converted to a grain size with the same number of tasks
+  const auto& cands = grid.cands;
+  const int num_cands = static_cast<int>(cands.size());
+  gsize = gsize <= 0 ? grid.rows() : gsize;
+  const int num_tasks = (grid.rows() + gsize - 1) / gsize;
+  const int grain = std::max(1, (num_cands + num_tasks - 1) / num_tasks);
+
+  const int n = tbb::parallel_reduce(
+      tbb::blocked_range<int>(0, num_cands, grain),
       0,
       [&](const auto& blk, int n) {
-        for (int gr = blk.begin(); gr < blk.end(); ++gr) {
-          n += MatchRow(grid, pano, gr);
+        for (int i = blk.begin(); i < blk.end(); ++i) {
+          n += MatchCell(grid, pano, grid.Ind2Px(cands[i]));
         }
         return n;
       },
       std::plus<>{});
-}
 
-int GicpSolver::MatchRow(SweepGrid& grid, const DepthPano& pano, int gr) {
-  int n = 0;
-  for (int gc = 0; gc < grid.cols(); ++gc) {
-    n += MatchCell(grid, pano, {gc, gr});
+  // Cells of different tasks may share a word, so valid bits are set here
+  grid.matches.valid.Clear();
+  for (const int i : cands) {
+    grid.matches.SetValid(i, grid.matches.At(i).Ok());
   }
   return n;
 }
@@ -54,12 +62,13 @@ int GicpSolver::MatchRow(SweepGrid& grid, const DepthPano& pano, int gr) {
 int GicpSolver::MatchCell(SweepGrid& grid,
                           const DepthPano& pano,
                           const cv::Point& px_g) {
-  auto& match = grid.MatchAt(px_g);
+  auto match = grid.MatchAt(px_g);
   if (!match.GridOk()) return 0;
 
   // Transform to pano frame
-  const auto& T_p_g = grid.TfAt(px_g.x);
-  const auto pt_g = T_p_g * match.mc_g.mean;  // grid point in pano frame
+  const int tc = grid.PoseCol(px_g);
+  const auto& T_p_g = grid.Tf34At(tc);
+  const auto pt_g = grid.TransformAt(tc, match.mc_g.mean);
   const auto rg_g = pt_g.norm();  // range of grid point in pano frame
 
   // Project to pano
@@ -93,7 +102,7 @@ int GicpSolver::MatchCell(SweepGrid& grid,
 
   // Now this is a good match, we update the px location
   match.px_p = px_p;
-  match.CalcSqrtInfo(T_p_g.rotationMatrix());
+  match.CalcSqrtInfo(T_p_g.leftCols<3>());
   // Although scale could be subsumed by U, we kept it for visualization
   // weight / pano_area is in [0, 1], but if it is too small, then imu cost will
   // dominate and drift. So we make this scale [0.5, 1]
@@ -13,6 +13,7 @@ struct GicpParams {
   float cov_lambda{1e-6F};
   double imu_weight{0.0};
   double min_eigval{0.0};
+  int max_matches{0};  // select matches by information, 0 means all
 };
 
 struct GicpSolver {
@@ -25,6 +26,7 @@ struct GicpSolver {
   cv::Size half_win{};  // pano window size
   double imu_weight{};  // how much weight to put on imu cost
   double min_eigval{};  // min eigenvalues for solution remapping
+  int max_matches{};    // max matches in solve, see GicpCost::SelectMatches
 
   /// @brief Repr / <<
   std::string Repr() const;
@@ -32,10 +34,9 @@ struct GicpSolver {
     return os << rhs.Repr();
   }
 
-  /// @brief Match features in sweep to pano using mask
+  /// @brief Match candidate cells of grid (see SweepGrid::cands) to pano
   /// @return Number of final matches
   int Match(SweepGrid& grid, const DepthPano& pano, int gsize = 0);
-  int MatchRow(SweepGrid& grid, const DepthPano& pano, int gr);
   int MatchCell(SweepGrid& grid, const DepthPano& pano, const cv::Point& px_g);
 };
 
@@ -21,12 +21,19 @@ TEST(GicpTest, TestMatch) {
   grid.Add(scan);
 
   DepthPano pano({1024, 256});
-  pano.dbuf.setTo(DepthPixel::kScale);
+  pano.Reset(cv::Scalar::all(DepthPixel::kScale));
 
   GicpSolver gicp;
 
   const auto n = gicp.Match(grid, pano);
   EXPECT_EQ(n, 1984);  // probably miss top and bottom
+
+  // Only candidates are matched, and valid matches are a subset of them
+  std::vector<int> inds;
+  EXPECT_EQ(grid.matches.GetValid(inds), n);
+  for (const int i : inds) {
+    EXPECT_TRUE(grid.cand_bits.Get(i));
+  }
 }
 
 void BM_GicpMatch(benchmark::State& state) {
@@ -35,7 +42,7 @@ void BM_GicpMatch(benchmark::State& state) {
   grid.Add(scan);
 
   DepthPano pano({1024, 256});
-  pano.dbuf.setTo(DepthPixel::kScale);
+  pano.Reset(cv::Scalar::all(DepthPixel::kScale));
 
   GicpSolver gicp;
 
@@ -47,5 +54,28 @@ void BM_GicpMatch(benchmark::State& state) {
 }
 BENCHMARK(BM_GicpMatch)->Arg(0)->Arg(1)->Arg(2)->Arg(4);
 
+void BM_GicpMatchSparse(benchmark::State& state) {
+  // Only 1 in every stride cells is a candidate, like a typical filter ratio
+  auto scan = MakeTestScan({1024, 64});
+  const int stride = state.range(0);
+  for (int c = 0; c < scan.cols(); ++c) {
+    if ((c / 16) % stride != 1) scan.mat.col(c).setTo(0);
+  }
+  scan.ExtractRange({0, scan.cols()});
+  auto grid = SweepGrid(scan.size());
+  grid.Add(scan);
+
+  DepthPano pano({1024, 256});
+  pano.Reset(cv::Scalar::all(DepthPixel::kScale));
+
+  GicpSolver gicp;
+
+  for (auto _ : state) {
+    const auto n = gicp.Match(grid, pano);
+    benchmark::DoNotOptimize(n);
+  }
+}
+BENCHMARK(BM_GicpMatchSparse)->Arg(4)->Arg(16);
+
 }  // namespace
 }  // namespace sv
@@ -5,6 +5,8 @@
 #include <tbb/blocked_range.h>
 #include <tbb/parallel_reduce.h>
 
+#include <algorithm>  // sort, nth_element
+#include <numeric>    // accumulate, partial_sum
 #include <opencv2/core.hpp>
 #include <sophus/interpolate.hpp>
 
@@ -16,33 +18,80 @@ SweepGrid::SweepGrid(const cv::Size& sweep_size, const GridParams& params)
     : ScanBase{sweep_size / cv::Size{params.cell_cols, params.cell_rows},
                kDtype},
       nms{params.nms},
+      nms_3x3{params.nms_3x3},
       max_curve{params.max_curve},
       max_var{params.max_var},
+      max_cands{params.max_cands},
+      buckets{params.bucket_cols, params.bucket_rows},
       cell_size{params.cell_cols, params.cell_rows} {
   CHECK_EQ(cell_size.width * cols(), sweep_size.width);
   CHECK_EQ(cell_size.height * rows(), sweep_size.height);
   CHECK_GE(cell_size.height, 1);
   CHECK_GE(cell_size.width, 8);
+  CHECK_GE(max_cands, 0);
+  CHECK(nms || !nms_3x3) << "nms_3x3 requires nms";
+  CHECK(0 < buckets.height && buckets.height <= rows());
+  CHECK(0 < buckets.width && buckets.width <= cols());
 
   mat.setTo(kNaNF);
-  matches.resize(total());
+  matches = MatchTable{size()};
+  cand_bits = GridBits{size()};
+  drop_bits = GridBits{size()};
 }
 
 std::string SweepGrid::Repr() const {
   return fmt::format(
-      "SweepGrid(size={}, cell_size={}, max_curve={}, max_var={}, nms={})",
+      "SweepGrid(size={}, cell_size={}, max_curve={}, max_var={}, nms={}, "
+      "nms_3x3={}, max_cands={}, buckets={})",
       sv::Repr(size()),
       sv::Repr(cell_size),
       max_curve,
       max_var,
-      nms);
+      nms,
+      nms_3x3,
+      max_cands,
+      sv::Repr(buckets));
 }
 
 cv::Vec2i SweepGrid::Add(const LidarScan& scan, int gsize) {
   CHECK_EQ(scan.rows(), rows() * cell_size.height);
-  const int num_valid_cells = Score(scan, gsize);
-  const int num_match_dells = Filter(scan, gsize);
-  return {num_valid_cells, num_match_dells};
+
+  // 3x3 nms needs scores of rows above and below, so all rows are scored
+  // before any of them is filtered
+  if (nms_3x3) {
+    const int n_valid = Score(scan, gsize);
+    return {n_valid, Filter(scan, gsize)};
+  }
+
+  UpdateTime(scan.time, scan.dt * cell_size.width);
+  UpdateView(scan.curr / cell_size.width);
+
+  gsize = gsize <= 0 ? rows() : gsize;
+  const auto n = tbb::parallel_reduce(
+      tbb::blocked_range<int>(0, rows(), gsize),
+      cv::Vec2i{0, 0},
+      [&](const auto& blk, cv::Vec2i n) {
+        for (int r = blk.begin(); r < blk.end(); ++r) {
+          const auto m = AddRow(scan, r);
+          n[0] += m[0];
+          n[1] += m[1];
+        }
+        return n;
+      },
+      [](const cv::Vec2i& a, const cv::Vec2i& b) {
+        return cv::Vec2i{a[0] + b[0], a[1] + b[1]};
+      });
+
+  Budget();
+  return n;
+}
+
+cv::Vec2i SweepGrid::AddRow(const LidarScan& scan, int r) {
+  // Filter of a row only depends on scores of the same row, so we can do it
+  // right after scoring while pixels of this row are still in cache
+  const int num_valid_cells = ScoreRow(scan, r);
+  const int num_good_cells = FilterRow(scan, r);
+  return {num_valid_cells, num_good_cells};
 }
 
 int SweepGrid::Score(const LidarScan& scan, int gsize) {
@@ -66,13 +115,24 @@ int SweepGrid::Score(const LidarScan& scan, int gsize) {
 
 int SweepGrid::ScoreRow(const LidarScan& scan, int r) {
   int n = 0;
+
+  // Note that we only take the first row of a staggered scan, because rows of
+  // a cell are not aligned in ouster lidar image
+  if (!scan.destaggered) {
+    // Cells of a row are contiguous in both scan and grid, so score them all
+    // at once, c starts from 0 in scan but is offset by curr.start in grid
+    auto* scores = &ScoreAt({curr.start, r});
+    scan.CalcScoreRow(Grid2Sweep({0, r}), cell_size.width, curr.size(), scores);
+    for (int c = 0; c < curr.size(); ++c) {
+      n += static_cast<int>(!std::isnan(scores[c][0]));  // could be nan
+    }
+    return n;
+  }
+
   for (int c = 0; c < curr.size(); ++c) {
-    // c starts from 0 in scan
+    // c starts from 0 in scan, rows are aligned so score all of them
     const auto px_s = Grid2Sweep({c, r});
-    // Note that we only take the first row regardless of row size
-    // this is because ouster lidar image is staggered.
-    // Maybe we will handle destaggering it later
-    const auto curve = scan.CalcScore(px_s, cell_size.width);
+    const auto curve = scan.CalcScore(cv::Rect{px_s, cell_size});
     // but the corresponding cell is within a sweep so need to offset
     ScoreAt({c + curr.start, r}) = curve;  // could be nan
     n += static_cast<int>(!std::isnan(curve[0]));
@@ -88,7 +148,7 @@ int SweepGrid::Filter(const LidarScan& scan, int gsize) {
   CHECK_EQ(new_curr.end, curr.end);
   gsize = gsize <= 0 ? rows() : gsize;
 
-  return tbb::parallel_reduce(
+  const int n = tbb::parallel_reduce(
       tbb::blocked_range<int>(0, rows(), gsize),
       0,
       [&](const auto& blk, int n) {
@@ -98,6 +158,10 @@ int SweepGrid::Filter(const LidarScan& scan, int gsize) {
         return n;
       },
       std::plus<>{});
+
+  // Cells outside curr keep their bits, so this covers the whole grid
+  Budget();
+  return n;
 }
 
 int SweepGrid::FilterRow(const LidarScan& scan, int r) {
@@ -109,10 +173,11 @@ int SweepGrid::FilterRow(const LidarScan& scan, int r) {
   for (int c = 0; c < curr.size(); ++c) {
     // Need offset for px grid
     const cv::Point px_g{c + curr.start, r};
-    auto& match = MatchAt(px_g);
+    auto match = MatchAt(px_g);
 
     // Reset it no matter what, to prevent accidently using old matches
     match.Reset();
+    matches.SetValid(Px2Ind(px_g), false);
 
     // Handle pad for nms
     if (pad <= c && c < curr.size() - pad && IsCellGood(px_g)) {
@@ -122,6 +187,10 @@ int SweepGrid::FilterRow(const LidarScan& scan, int r) {
       match.px_g = px_g;
       ++n;
     }
+    // Bits of a row do not share words with other rows. A cell dropped by
+    // Budget() in the last sweep is replaced by the new one
+    cand_bits.Set(Px2Ind(px_g), match.GridOk());
+    drop_bits.Set(Px2Ind(px_g), false);
   }
   return n;
 }
@@ -140,32 +209,135 @@ bool SweepGrid::IsCellGood(const cv::Point& px) const {
     if (m[0] > l[0] || m[0] > r[0]) return false;
   }
 
+  // Rows above and below, there is no neighbor outside of grid
+  if (nms_3x3) {
+    for (const int y : {px.y - 1, px.y + 1}) {
+      if (y < 0 || y >= rows()) continue;
+      for (int x = px.x - 1; x <= px.x + 1; ++x) {
+        if (m[0] > ScoreAt({x, y})[0]) return false;
+      }
+    }
+  }
+
   return true;
 }
 
-void SweepGrid::Interp(const Trajectory& traj) {
-  CHECK_EQ(tfs.size() + 1, traj.size());
+int SweepGrid::Budget() {
+  // Cells dropped by an earlier call compete again, a cell only leaves for
+  // good when its col is filtered again in the next sweep
+  for (size_t w = 0; w < cand_bits.words.size(); ++w) {
+    cand_bits.words[w] |= drop_bits.words[w];
+  }
+  drop_bits.Clear();
+
+  const int n_cands = cand_bits.Collect(cands);
+  if (max_cands <= 0 || n_cands <= max_cands) return 0;
+
+  const auto curve = [this](int i) { return ScoreAt(Ind2Px(i))[0]; };
+  const auto bucket = [this](int i) { return BucketAt(Ind2Px(i)); };
+  const auto by_curve = [&](int i0, int i1) { return curve(i0) < curve(i1); };
 
-  for (int gc = 0; gc < tfs.size(); ++gc) {
-    // Note that the starting point of traj is where curr ends, so we need to
-    // offset by curr.end to find the corresponding traj segment
-    const int tc = WrapCols(gc - curr.end, cols());
-    const auto& st0 = traj.At(tc);
-    const auto& st1 = traj.At(tc + 1);
-
-    Sophus::SE3d tf_p_i;
-    tf_p_i.so3() = Sophus::interpolate(st0.rot, st1.rot, 0.5);
-    tf_p_i.translation() = (st0.pos + st1.pos) / 2.0;
-    tfs.at(gc) = (tf_p_i * traj.T_imu_lidar).cast<float>();
+  // Group cells by bucket with a counting sort, which is linear
+  const int n_buckets = buckets.area();
+  std::vector<int> starts(n_buckets + 1, 0);
+  for (const int i : cands) ++starts[bucket(i) + 1];
+  std::partial_sum(starts.begin(), starts.end(), starts.begin());
+  std::vector<int> grouped(n_cands);
+  auto next = starts;
+  for (const int i : cands) grouped[next[bucket(i)]++] = i;
+
+  // Take the best quota cells of each bucket to the front, buckets with fewer
+  // cells leave their share to the rest. Only the quota needs to be found, not
+  // sorted, so nth_element is enough
+  const int quota = max_cands / n_buckets;
+  int n_kept = 0;
+  int n_rest = n_cands;
+  for (int b = 0; b < n_buckets; ++b) {
+    const auto first = grouped.begin() + starts[b];
+    const auto last = grouped.begin() + starts[b + 1];
+    const auto nth = first + std::min<int>(quota, last - first);
+    if (nth < last) std::nth_element(first, nth, last, by_curve);
+    std::copy(first, nth, cands.begin() + n_kept);
+    n_kept += static_cast<int>(nth - first);
+    // Rest goes to the back of cands in reverse, order does not matter
+    for (auto it = nth; it != last; ++it) cands[--n_rest] = *it;
   }
+
+  // Fill the remaining budget with the best of the cells left
+  const auto rest = cands.begin() + n_kept;
+  const auto keep = cands.begin() + max_cands;
+  std::nth_element(rest, keep, cands.end(), by_curve);
+
+  // Dropped cells keep their grid match so a later call can take them back,
+  // but any pano match is stale by then
+  for (auto it = keep; it != cands.end(); ++it) {
+    cand_bits.Set(*it, false);
+    drop_bits.Set(*it, true);
+    matches.At(*it).ResetPano();
+  }
+
+  cands.resize(max_cands);
+  std::sort(cands.begin(), cands.end());
+  return n_cands - max_cands;
 }
 
-int SweepGrid::NumCandidates() const {
-  int n = 0;
-  for (const auto& match : matches) {
-    n += static_cast<int>(match.GridOk());
+void SweepGrid::SetShifts(const std::vector<int>& pixel_shifts) {
+  shifts.clear();
+  if (pixel_shifts.empty()) return;
+
+  CHECK_EQ(static_cast<int>(pixel_shifts.size()), rows() * cell_size.height)
+      << "Need one pixel shift per sweep row";
+  shifts.resize(rows());
+  for (int r = 0; r < rows(); ++r) {
+    const auto first = pixel_shifts.begin() + r * cell_size.height;
+    const int sum = std::accumulate(first, first + cell_size.height, 0);
+    shifts[r] = (sum + cell_size.height / 2) / cell_size.height;
   }
-  return n;
+}
+
+int SweepGrid::Interp(const Trajectory& traj, int gsize) {
+  CHECK_EQ(tfs.size() + 1, traj.size());
+  const int num_cells = cols();
+  gsize = gsize <= 0 ? num_cells : gsize;
+
+  knots.Update(traj, curr.end);
+
+  return tbb::parallel_reduce(
+      tbb::blocked_range<int>(0, num_cells, gsize),
+      0,
+      [&](const auto& blk, int n) {
+        for (int gc = blk.begin(); gc < blk.end(); ++gc) {
+          // Note that the starting point of traj is where curr ends, so we
+          // need to offset by curr.end to find the corresponding traj segment
+          const int tc = WrapCols(gc - curr.end, num_cells);
+          const auto& st0 = traj.At(tc);
+          const auto& st1 = traj.At(tc + 1);
+
+          switch (knots.Update(gc, st0, st1)) {
+            case KnotCache::Action::kKeep:
+              break;
+            case KnotCache::Action::kCorrect: {
+              // Cell pose is the midpoint of its knots, which is moved by corr
+              // exactly as the knots are
+              const auto& corr = knots.corr;
+              const auto t_mid = (st0.time + st1.time) / 2.0;
+              const Sophus::SE3d dT{corr.rot, corr.TransAt(t_mid)};
+              SetTfAt(gc, dT.cast<float>() * tfs[gc]);
+              break;
+            }
+            case KnotCache::Action::kInterp: {
+              Sophus::SE3d tf_p_i;
+              tf_p_i.so3() = Sophus::interpolate(st0.rot, st1.rot, 0.5);
+              tf_p_i.translation() = (st0.pos + st1.pos) / 2.0;
+              SetTfAt(gc, (tf_p_i * traj.T_imu_lidar).cast<float>());
+              ++n;
+              break;
+            }
+          }
+        }
+        return n;
+      },
+      std::plus<>{});
 }
 
 cv::Mat SweepGrid::DrawFilter() const {
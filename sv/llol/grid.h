@@ -10,8 +10,12 @@ struct GridParams {
   int cell_rows{2};
   int cell_cols{16};
   bool nms{true};          // non-minimum suppression in Filter()
+  bool nms_3x3{false};     // nms also with cells in rows above and below
   float max_curve{0.01F};  // score > max_score will be discarded
   float max_var{0.01F};    // var > max_score will be discarded
+  int max_cands{0};        // feature budget of whole grid, 0 means no limit
+  int bucket_rows{2};      // number of row bands for max_cands
+  int bucket_cols{8};      // number of azimuth sectors for max_cands
 };
 
 /// @struct Sweep Grid summarizes sweep into reduced-sized grid
@@ -21,12 +25,25 @@ struct SweepGrid final : public ScanBase {
 
   /// Params
   bool nms{};
+  bool nms_3x3{};
   float max_curve{};
   float max_var{};
+  int max_cands{};
+  cv::Size buckets{};
   cv::Size cell_size;
 
   /// Data
-  std::vector<PointMatch> matches;  // all matches
+  MatchTable matches;      // one match per cell
+  GridBits cand_bits;      // cells that pass Filter() and Budget()
+  GridBits drop_bits;      // cells that pass Filter() but not Budget()
+  std::vector<int> cands;  // indices of cells in cand_bits, see Filter()
+
+  /// Pixel shift of each row of cells in a destaggered sweep, empty means
+  /// staggered, see SetShifts()
+  std::vector<int> shifts;
+
+  /// Knots of each cell used in the last Interp(), clear to force a full one
+  KnotCache knots;
 
   SweepGrid() = default;
   explicit SweepGrid(const cv::Size& sweep_size, const GridParams& params = {});
@@ -37,8 +54,12 @@ struct SweepGrid final : public ScanBase {
     return os << rhs.Repr();
   }
 
-  /// @brief Score, Filter and Reduce
+  /// @brief Score and Filter in a single pass over rows, this gives the same
+  /// result as Score() followed by Filter() since nms only looks within a row.
+  /// With nms_3x3 all rows are scored before filtering in a second pass
+  /// @return Number of valid cells and number of good cells
   cv::Vec2i Add(const LidarScan& scan, int gsize = 0);
+  cv::Vec2i AddRow(const LidarScan& scan, int r);
 
   /// @brief Score each cell of the incoming scan
   /// @param gsize is number of rows per task, <=0 means single thread
@@ -46,18 +67,32 @@ struct SweepGrid final : public ScanBase {
   int Score(const LidarScan& scan, int gsize = 0);
   int ScoreRow(const LidarScan& scan, int r);
 
-  /// @brief
+  /// @brief Filter cells in curr and update the list of candidate cells, which
+  /// is then capped by Budget()
+  /// @return Number of good cells in curr, before Budget()
   int Filter(const LidarScan& scan, int gisze = 0);
   int FilterRow(const LidarScan& scan, int r);
-  /// @brief Check whether this cell is good or not for Filter()
+  /// @brief Check whether this cell is good or not for Filter(), with nms_3x3
+  /// scores of rows above and below must be ready
   bool IsCellGood(const cv::Point& px) const;
+  /// @brief Collect candidates and keep at most max_cands of them, each bucket
+  /// keeps an equal share of its lowest curve cells for coverage, the rest of
+  /// the budget goes to the lowest curve cells left, called by Add() and
+  /// Filter(). Cells dropped by an earlier call are considered again until
+  /// their col is filtered in the next sweep
+  /// @return Number of candidates dropped
+  int Budget();
+  int BucketAt(const cv::Point& px) const {
+    return (px.y * buckets.height / rows()) * buckets.width +
+           px.x * buckets.width / cols();
+  }
 
   /// @brief At
   auto& ScoreAt(const cv::Point& px) { return mat.at<PixelT>(px); }
   const auto& ScoreAt(const cv::Point& px) const { return mat.at<PixelT>(px); }
-  PointMatch& MatchAt(const cv::Point& px) { return matches.at(Px2Ind(px)); }
-  const PointMatch& MatchAt(const cv::Point& px) const {
-    return matches.at(Px2Ind(px));
+  MatchRef MatchAt(const cv::Point& px) { return matches.At(Px2Ind(px)); }
+  MatchCRef MatchAt(const cv::Point& px) const {
+    return matches.At(Px2Ind(px));
   }
 
   /// @brief Pxiel coordinates conversion (sweep <-> grid)
@@ -68,11 +103,28 @@ struct SweepGrid final : public ScanBase {
     return {px.x * cell_size.width, px.y * cell_size.height};
   }
   int Px2Ind(const cv::Point& px) const { return px.y * cols() + px.x; }
+  cv::Point Ind2Px(int i) const { return {i % cols(), i / cols()}; }
+
+  /// @brief Set shifts from per row pixel shifts of the sweep (normalized as in
+  /// LidarSweep::shifts), each row of cells takes the mean of its rows
+  void SetShifts(const std::vector<int>& pixel_shifts);
+  /// @brief Col of tfs for cell px, which is the col of its middle scan col,
+  /// see LidarSweep::PoseCol()
+  int PoseCol(const cv::Point& px) const {
+    if (shifts.empty()) return px.x;
+    const int sc = Grid2Sweep(px).x + cell_size.width / 2;
+    const int sweep_cols = cols() * cell_size.width;
+    return WrapCols(sc - shifts[px.y], sweep_cols) / cell_size.width;
+  }
 
-  /// @brief Interpolate poses of each col (cell)
-  void Interp(const Trajectory& traj);
+  /// @brief Interpolate poses of each col (cell), cells whose knots were only
+  /// moved by a KnotCorrection (e.g. after icp) are corrected instead
+  /// @param gsize is number of cells per task, <=0 means single thread
+  /// @return Number of cells interpolated from scratch
+  int Interp(const Trajectory& traj, int gsize = 0);
 
-  int NumCandidates() const;
+  /// @brief Number of candidate cells in the whole grid
+  int NumCandidates() const { return static_cast<int>(cands.size()); }
 
   /// @brief Draw
   cv::Mat DrawFilter() const;
@@ -3,6 +3,11 @@
 #include <benchmark/benchmark.h>
 #include <gtest/gtest.h>
 
+#include <cstring>  // memcmp
+#include <random>
+
+#include "sv/llol/sweep.h"  // MakeTestSweep
+
 namespace sv {
 namespace {
 
@@ -53,6 +58,346 @@ TEST(GridTest, TestScore) {
   std::cout << grid << std::endl;
 }
 
+TEST(GridTest, TestScoreLayout) {
+  const auto packed = MakeTestSweep({1024, 64});
+  const auto planar = MakeTestSweep({1024, 64}, ScanLayout::kPlanar);
+
+  SweepGrid grid0(packed.size());
+  SweepGrid grid1(planar.size());
+  EXPECT_EQ(grid0.Score(packed), grid1.Score(planar));
+  EXPECT_EQ(grid0.Filter(packed), grid1.Filter(planar));
+
+  // Score only depends on range, so compact is the same as well
+  const auto compact = MakeTestSweep({1024, 64}, ScanLayout::kCompact);
+  SweepGrid grid2(compact.size());
+  EXPECT_EQ(grid0.Score(packed), grid2.Score(compact));
+
+  for (int r = 0; r < grid0.rows(); ++r) {
+    for (int c = 0; c < grid0.cols(); ++c) {
+      EXPECT_EQ(grid0.ScoreAt({c, r}), grid1.ScoreAt({c, r}));
+      EXPECT_EQ(grid0.ScoreAt({c, r}), grid2.ScoreAt({c, r}));
+    }
+  }
+}
+
+TEST(GridTest, TestFilterDestagger) {
+  auto scan = MakeTestScan({1024, 64});
+  SweepGrid grid(scan.size());
+
+  // Staggered scan only uses the first row of a cell
+  grid.Add(scan);
+  EXPECT_EQ(grid.MatchAt({1, 0}).mc_g.n, grid.cell_size.width);
+
+  scan.destaggered = true;
+  grid.Add(scan);
+  EXPECT_EQ(grid.MatchAt({1, 0}).mc_g.n, grid.cell_size.area());
+}
+
+TEST(GridTest, TestAddFused) {
+  auto scan = MakeTestScan({1024, 64});
+  // Make some cells bad so that filter has something to do
+  for (int c = 0; c < scan.cols(); c += 24) {
+    scan.mat.col(c).setTo(0);
+  }
+  scan.ExtractRange({0, scan.cols()});
+
+  SweepGrid grid0(scan.size());
+  SweepGrid grid1(scan.size());
+  const int n_valid = grid0.Score(scan);
+  const int n_good = grid0.Filter(scan);
+  const auto n = grid1.Add(scan, 4);
+  EXPECT_EQ(n[0], n_valid);
+  EXPECT_EQ(n[1], n_good);
+  EXPECT_EQ(grid0.curr.end, grid1.curr.end);
+
+  // Candidates are exactly the cells that pass filter
+  int n_cands = 0;
+  for (int i = 0; i < grid1.total(); ++i) {
+    n_cands += static_cast<int>(grid1.matches.At(i).GridOk());
+  }
+  EXPECT_EQ(grid0.NumCandidates(), n_cands);
+  EXPECT_EQ(grid1.NumCandidates(), n_cands);
+  for (const int i : grid1.cands) {
+    EXPECT_TRUE(grid1.matches.At(i).GridOk());
+  }
+
+  for (int r = 0; r < grid0.rows(); ++r) {
+    for (int c = 0; c < grid0.cols(); ++c) {
+      const auto s0 = grid0.ScoreAt({c, r});
+      const auto s1 = grid1.ScoreAt({c, r});
+      EXPECT_EQ(std::isnan(s0[0]), std::isnan(s1[0]));
+      if (!std::isnan(s0[0])) EXPECT_EQ(s0, s1);
+      EXPECT_EQ(grid0.MatchAt({c, r}).GridOk(), grid1.MatchAt({c, r}).GridOk());
+      EXPECT_EQ(grid0.MatchAt({c, r}).mc_g.n, grid1.MatchAt({c, r}).mc_g.n);
+    }
+  }
+}
+
+TEST(GridTest, TestBudget) {
+  auto scan = MakeTestScan({1024, 64});
+  GridParams gp;
+  SweepGrid grid0(scan.size(), gp);
+  gp.max_cands = 100;
+  SweepGrid grid1(scan.size(), gp);
+  grid0.Add(scan);
+  grid1.Add(scan);
+  ASSERT_GT(grid0.NumCandidates(), gp.max_cands);
+  EXPECT_EQ(grid1.NumCandidates(), gp.max_cands);
+  EXPECT_TRUE(std::is_sorted(grid1.cands.begin(), grid1.cands.end()));
+
+  // Kept cells are a subset of candidates without budget
+  std::vector<int> counts0(grid1.buckets.area(), 0);
+  std::vector<int> counts1(grid1.buckets.area(), 0);
+  for (const int i : grid0.cands) ++counts0[grid0.BucketAt(grid0.Ind2Px(i))];
+  for (const int i : grid1.cands) {
+    EXPECT_TRUE(grid0.cand_bits.Get(i));
+    EXPECT_TRUE(grid1.matches.At(i).GridOk());
+    ++counts1[grid1.BucketAt(grid1.Ind2Px(i))];
+  }
+
+  // Dropped cells are no longer candidates, but are kept for later
+  int n_dropped = 0;
+  for (int i = 0; i < grid1.total(); ++i) {
+    const bool kept = grid1.cand_bits.Get(i);
+    const bool dropped = grid1.drop_bits.Get(i);
+    EXPECT_FALSE(kept && dropped);
+    EXPECT_EQ(kept || dropped, grid0.cand_bits.Get(i));
+    EXPECT_EQ(kept || dropped, grid1.matches.At(i).GridOk());
+    n_dropped += static_cast<int>(dropped);
+  }
+  EXPECT_EQ(n_dropped, grid0.NumCandidates() - gp.max_cands);
+
+  // Every bucket gets its share if it has enough cells
+  const int quota = gp.max_cands / grid1.buckets.area();
+  for (int b = 0; b < grid1.buckets.area(); ++b) {
+    EXPECT_GE(counts1[b], std::min(quota, counts0[b]));
+  }
+
+  // Dropped cells come back once there is room for them
+  const auto cands1 = grid1.cands;
+  grid1.max_cands = 2 * gp.max_cands;
+  EXPECT_EQ(grid1.Budget(), grid0.NumCandidates() - grid1.max_cands);
+  EXPECT_EQ(grid1.NumCandidates(), grid1.max_cands);
+  grid1.max_cands = 0;
+  EXPECT_EQ(grid1.Budget(), 0);
+  EXPECT_EQ(grid1.cands, grid0.cands);
+
+  // A new sweep replaces the dropped cells
+  grid1.max_cands = gp.max_cands;
+  grid1.Add(scan);
+  EXPECT_EQ(grid1.cands, cands1);
+}
+
+TEST(GridTest, TestNms3x3) {
+  // Perturb ranges so that cells have different curves
+  auto scan = MakeTestScan({1024, 64});
+  std::mt19937 gen(42);
+  std::uniform_int_distribution<int> dist(0, 8);
+  for (int r = 0; r < scan.rows(); ++r) {
+    for (int c = 0; c < scan.cols(); ++c) {
+      scan.mat.at<ScanPixel>(r, c).range_raw += dist(gen);
+    }
+  }
+  scan.ExtractRange({0, scan.cols()});
+
+  GridParams gp;
+  gp.max_curve = gp.max_var = 1.0F;
+  SweepGrid grid1(scan.size(), gp);
+  gp.nms_3x3 = true;
+  SweepGrid grid2(scan.size(), gp);
+  SweepGrid grid3(scan.size(), gp);
+
+  const auto n1 = grid1.Add(scan);
+  const auto n2 = grid2.Add(scan, 4);
+  // Add is the same as Score followed by Filter
+  EXPECT_EQ(grid3.Score(scan), n2[0]);
+  EXPECT_EQ(grid3.Filter(scan), n2[1]);
+  EXPECT_EQ(grid3.cands, grid2.cands);
+
+  // 3x3 keeps a subset of cells that 1d nms keeps
+  EXPECT_EQ(n1[0], n2[0]);
+  EXPECT_LT(n2[1], n1[1]);
+  for (const int i : grid2.cands) EXPECT_TRUE(grid1.cand_bits.Get(i));
+
+  // Each good cell is a local minimum of its 3x3 neighbors within grid
+  for (const int i : grid2.cands) {
+    const auto px = grid2.Ind2Px(i);
+    const auto m = grid2.ScoreAt(px)[0];
+    const int y0 = std::max(px.y - 1, 0);
+    const int y1 = std::min(px.y + 1, grid2.rows() - 1);
+    for (int y = y0; y <= y1; ++y) {
+      for (int x = px.x - 1; x <= px.x + 1; ++x) {
+        EXPECT_FALSE(m > grid2.ScoreAt({x, y})[0]) << px << " " << x << y;
+      }
+    }
+  }
+}
+
+Trajectory MakeTestTraj(int size) {
+  Trajectory traj(size);
+  traj.T_imu_lidar.translation() = Eigen::Vector3d{0.1, 0.2, 0.3};
+  for (int i = 0; i < traj.size(); ++i) {
+    auto& st = traj.At(i);
+    st.time = 0.01 * i;
+    st.rot = Sophus::SO3d::exp(Eigen::Vector3d{0.01, 0.02, 0.03} * i);
+    st.pos = Eigen::Vector3d{1.0, 2.0, 3.0} * i;
+  }
+  return traj;
+}
+
+void ExpectSameTfs(const SweepGrid& grid, const Trajectory& traj) {
+  SweepGrid full({1024, 64});
+  full.curr = grid.curr;
+  full.Interp(traj);
+  for (int c = 0; c < grid.cols(); ++c) {
+    EXPECT_TRUE(grid.Tf34At(c).isApprox(full.Tf34At(c), 1e-5)) << c;
+  }
+}
+
+TEST(GridTest, TestInterp) {
+  SweepGrid grid({1024, 64});
+  grid.curr = {0, 4};
+  auto traj = MakeTestTraj(grid.cols() + 1);
+
+  EXPECT_EQ(grid.Interp(traj, 8), grid.cols());
+  EXPECT_EQ(grid.Interp(traj, 8), 0);
+  ExpectSameTfs(grid, traj);
+
+  // Correct first state and velocity then repredict, as after icp
+  const Sophus::SO3d eR = Sophus::SO3d::exp({0.01, 0.02, -0.01});
+  const Eigen::Vector3d a{0.1, 0.0, -0.1};
+  const Eigen::Vector3d b{1.0, -2.0, 0.5};
+  for (auto& st : traj.states) {
+    st.rot = eR * st.rot;
+    st.pos = eR * st.pos + a + b * st.time;
+  }
+  EXPECT_EQ(grid.Interp(traj, 8), 0);
+  ExpectSameTfs(grid, traj);
+
+  // Change a single knot, which affects two cells
+  traj.At(4).pos.x() += 1.0;
+  EXPECT_EQ(grid.Interp(traj, 8), 2);
+  ExpectSameTfs(grid, traj);
+
+  // Force full
+  grid.knots.clear();
+  EXPECT_EQ(grid.Interp(traj), grid.cols());
+}
+
+TEST(GridTest, TestPoseCol) {
+  SweepGrid grid({1024, 4});
+  EXPECT_EQ(grid.PoseCol({1, 1}), 1);
+
+  // Each row of cells takes the mean pixel shift of its two rows
+  grid.SetShifts({0, 2, 16, 18});
+  EXPECT_EQ(grid.shifts, std::vector<int>({1, 17}));
+
+  // Middle col of cell 1 is 24, which holds scan col 23 or 7
+  EXPECT_EQ(grid.PoseCol({1, 0}), 1);
+  EXPECT_EQ(grid.PoseCol({1, 1}), 0);
+  // Scan col of the first cell wraps around to the last one
+  EXPECT_EQ(grid.PoseCol({0, 1}), grid.cols() - 1);
+
+  grid.SetShifts({});
+  EXPECT_EQ(grid.PoseCol({0, 1}), 0);
+}
+
+TEST(GridTest, TestMatchTable) {
+  // Width is not a multiple of 64 so rows have padding bits
+  MatchTable table({100, 3});
+  EXPECT_EQ(table.total(), 300);
+  EXPECT_EQ(table.valid.words.size(), 6);
+
+  auto match = table.At(150);
+  EXPECT_FALSE(match.GridOk());
+  match.px_g = {50, 1};
+  match.mc_g.n = 2;
+  EXPECT_TRUE(table.At(150).GridOk());
+  match.Reset();
+  EXPECT_EQ(table.px_g[150].x, MatchTable::kBadPx);
+
+  std::vector<int> inds;
+  EXPECT_EQ(table.GetValid(inds), 0);
+  for (const int i : {0, 63, 64, 99, 100, 299}) table.SetValid(i, true);
+  table.SetValid(63, false);
+  EXPECT_EQ(table.GetValid(inds), 5);
+  EXPECT_EQ(inds, std::vector<int>({0, 64, 99, 100, 299}));
+  EXPECT_TRUE(table.IsValid(100));
+  EXPECT_FALSE(table.IsValid(101));
+}
+
+/// @brief Random raw ranges with some invalid (0) ones
+std::vector<uint16_t> MakeRandomRanges(int n) {
+  std::mt19937 gen(42);
+  std::uniform_int_distribution<int> dist(0, 65535);
+  std::vector<uint16_t> ranges(n);
+  for (auto& rg : ranges) {
+    rg = static_cast<uint16_t>(dist(gen));
+    if (rg % 8 == 0) rg = 0;
+  }
+  return ranges;
+}
+
+TEST(GridTest, TestScoreSimd) {
+  std::cout << "simd: " << Repr(GetSimdLevel()) << std::endl;
+  const auto ranges = MakeRandomRanges(1024);
+
+  // Smooth cells so that some of them are valid and have small scores
+  auto smooth = ranges;
+  for (int i = 0; i < static_cast<int>(smooth.size()); ++i) {
+    if (smooth[i] > 0) smooth[i] = 20000 + smooth[i] % 64;
+  }
+
+  for (const auto& data : {ranges, smooth}) {
+    for (const int width : {8, 12, 16, 32}) {
+      const int num = data.size() / width;
+      std::vector<cv::Vec2f> s0(num);
+      std::vector<cv::Vec2f> s1(num);
+      ScoreCells(
+          data.data(), width, num, 512.0, s0.data(), SimdLevel::kScalar);
+      ScoreCells(data.data(), width, num, 512.0, s1.data(), GetSimdLevel());
+      // Bit compatible, including nan
+      EXPECT_EQ(std::memcmp(s0.data(), s1.data(), num * sizeof(cv::Vec2f)), 0)
+          << "width: " << width;
+    }
+  }
+
+  // Grid uses the same kernel
+  auto scan = MakeTestScan({1024, 64});
+  std::copy(smooth.begin(), smooth.end(), scan.range.ptr<uint16_t>(0));
+  SweepGrid grid(scan.size());
+  grid.Score(scan);
+  std::vector<cv::Vec2f> s0(grid.cols());
+  ScoreCells(
+      smooth.data(), 16, grid.cols(), 512.0, s0.data(), SimdLevel::kScalar);
+  for (int c = 0; c < grid.cols(); ++c) {
+    const auto s1 = grid.ScoreAt({c, 0});
+    EXPECT_EQ(std::memcmp(&s0[c], &s1, sizeof(s1)), 0) << "col: " << c;
+  }
+}
+
+void BM_ScoreCells(benchmark::State& state) {
+  const auto ranges = MakeRandomRanges(2048);
+  const int width = state.range(0);
+  const auto level = static_cast<SimdLevel>(state.range(1));
+  if (level > GetSimdLevel()) {
+    state.SkipWithError("Simd level not supported");
+    return;
+  }
+  const int num = ranges.size() / width;
+  std::vector<cv::Vec2f> scores(num);
+
+  for (auto _ : state) {
+    ScoreCells(ranges.data(), width, num, 512.0, scores.data(), level);
+    benchmark::DoNotOptimize(scores);
+  }
+}
+BENCHMARK(BM_ScoreCells)
+    ->Args({16, static_cast<int>(SimdLevel::kScalar)})
+    ->Args({16, static_cast<int>(SimdLevel::kAvx2)})
+    ->Args({32, static_cast<int>(SimdLevel::kScalar)})
+    ->Args({32, static_cast<int>(SimdLevel::kAvx2)});
+
 void BM_GridScore(benchmark::State& state) {
   const auto scan = MakeTestScan({1024, 64});
   SweepGrid grid(scan.size());
@@ -65,6 +410,25 @@ void BM_GridScore(benchmark::State& state) {
 }
 BENCHMARK(BM_GridScore)->Arg(0)->Arg(1)->Arg(2)->Arg(4)->Arg(8);
 
+void BM_GridScoreLayout(benchmark::State& state) {
+  const cv::Size size(state.range(0), state.range(1));
+  const auto layout = static_cast<ScanLayout>(state.range(2));
+  const auto sweep = MakeTestSweep(size, layout);
+  SweepGrid grid(sweep.size());
+
+  for (auto _ : state) {
+    auto n = grid.Score(sweep);
+    benchmark::DoNotOptimize(n);
+  }
+}
+BENCHMARK(BM_GridScoreLayout)
+    ->Args({1024, 64, static_cast<int>(ScanLayout::kPacked)})
+    ->Args({1024, 64, static_cast<int>(ScanLayout::kPlanar)})
+    ->Args({1024, 64, static_cast<int>(ScanLayout::kCompact)})
+    ->Args({2048, 128, static_cast<int>(ScanLayout::kPacked)})
+    ->Args({2048, 128, static_cast<int>(ScanLayout::kPlanar)})
+    ->Args({2048, 128, static_cast<int>(ScanLayout::kCompact)});
+
 void BM_GridFilter(benchmark::State& state) {
   const auto scan = MakeTestScan({1024, 64});
   SweepGrid grid(scan.size());
@@ -78,5 +442,47 @@ void BM_GridFilter(benchmark::State& state) {
 }
 BENCHMARK(BM_GridFilter)->Arg(0)->Arg(1)->Arg(2)->Arg(4)->Arg(8);
 
+void BM_GridScoreFilter(benchmark::State& state) {
+  const auto scan = MakeTestScan({1024, 64});
+  SweepGrid grid(scan.size());
+  const int gsize = state.range(0);
+
+  for (auto _ : state) {
+    auto n = grid.Score(scan, gsize);
+    n += grid.Filter(scan, gsize);
+    benchmark::DoNotOptimize(n);
+  }
+}
+BENCHMARK(BM_GridScoreFilter)->Arg(0)->Arg(1)->Arg(2)->Arg(4)->Arg(8);
+
+void BM_GridAdd(benchmark::State& state) {
+  const auto scan = MakeTestScan({1024, 64});
+  SweepGrid grid(scan.size());
+  const int gsize = state.range(0);
+
+  for (auto _ : state) {
+    auto n = grid.Add(scan, gsize);
+    benchmark::DoNotOptimize(n);
+  }
+}
+BENCHMARK(BM_GridAdd)->Arg(0)->Arg(1)->Arg(2)->Arg(4)->Arg(8);
+
+void BM_GridInterp(benchmark::State& state) {
+  SweepGrid grid({1024, 64});
+  auto traj = MakeTestTraj(grid.cols() + 1);
+  const bool incremental = state.range(0);
+  const Sophus::SE3d dT{Sophus::SO3d::exp({0.01, 0.02, -0.01}), {0.1, 0, 0}};
+  grid.Interp(traj);
+
+  for (auto _ : state) {
+    // Rigid correction of the whole traj, like between outer icp iterations
+    traj.MoveFrame(dT);
+    if (!incremental) grid.knots.clear();
+    auto n = grid.Interp(traj);
+    benchmark::DoNotOptimize(n);
+  }
+}
+BENCHMARK(BM_GridInterp)->Arg(0)->Arg(1);
+
 }  // namespace
 }  // namespace sv
@@ -3,11 +3,191 @@
 #include <fmt/core.h>
 #include <glog/logging.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #include "sv/util/math.h"
 #include "sv/util/ocv.h"
 
 namespace sv {
 
+namespace {
+
+/// Coefficients of atan(a) = a * (k1 + k3 a^2 + ... + k9 a^8) for a in [0, 1],
+/// |err| < 1e-5 rad, Abramowitz and Stegun 4.4.49
+constexpr float kAtan1 = 0.9998660F;
+constexpr float kAtan3 = -0.3302995F;
+constexpr float kAtan5 = 0.1801410F;
+constexpr float kAtan7 = -0.0851330F;
+constexpr float kAtan9 = 0.0208351F;
+
+/// @brief atan2 from polynomial atan of min(|x|, |y|) / max(|x|, |y|)
+float Atan2Fast(float y, float x) {
+  const float ax = std::abs(x);
+  const float ay = std::abs(y);
+  const float mx = std::max(ax, ay);
+  const float a = mx > 0 ? std::min(ax, ay) / mx : 0.0F;
+  const float a2 = a * a;
+  float t =
+      a * (kAtan1 + a2 * (kAtan3 + a2 * (kAtan5 + a2 * (kAtan7 + a2 * kAtan9))));
+  if (ay > ax) t = kPiF / 2 - t;
+  if (x < 0) t = kPiF - t;
+  return std::copysign(t, y);
+}
+
+/// @brief Same as LidarModel::Forward(), but with asin(z / r) replaced by
+/// atan2(z, rxy), so both angles use the same polynomial
+void ForwardFastScalar(const LidarModel& model,
+                       const float* xs,
+                       const float* ys,
+                       const float* zs,
+                       int n,
+                       cv::Point* pxs) {
+  for (int i = 0; i < n; ++i) {
+    const float x = xs[i];
+    const float y = ys[i];
+    const float z = zs[i];
+    const float rxy2 = x * x + y * y;
+    const float r2 = rxy2 + z * z;
+
+    const float elev = Atan2Fast(z, std::sqrt(rxy2));
+    const float row = std::nearbyint((model.elev_max - elev) / model.elev_delta);
+    const float azim = Atan2Fast(y, -x) + kPiF;
+    const float col = azim / model.azim_delta;
+
+    // Check in float, which also rejects nan
+    if (r2 > 0 && model.RowInside(row) && model.ColInside(col)) {
+      pxs[i] = {static_cast<int>(col), static_cast<int>(row)};
+    } else {
+      pxs[i] = {-1, -1};
+    }
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"), always_inline)) inline __m256 Atan2Avx2(
+    __m256 y,
+    __m256 x) {
+  const auto sign = _mm256_set1_ps(-0.0F);
+  const auto ax = _mm256_andnot_ps(sign, x);
+  const auto ay = _mm256_andnot_ps(sign, y);
+  const auto mx = _mm256_max_ps(ax, ay);
+  const auto mn = _mm256_min_ps(ax, ay);
+  // a is 0 where both x and y are 0
+  const auto a = _mm256_and_ps(
+      _mm256_div_ps(mn, mx),
+      _mm256_cmp_ps(mx, _mm256_setzero_ps(), _CMP_GT_OQ));
+  const auto a2 = _mm256_mul_ps(a, a);
+
+  auto t = _mm256_set1_ps(kAtan9);
+  t = _mm256_add_ps(_mm256_mul_ps(t, a2), _mm256_set1_ps(kAtan7));
+  t = _mm256_add_ps(_mm256_mul_ps(t, a2), _mm256_set1_ps(kAtan5));
+  t = _mm256_add_ps(_mm256_mul_ps(t, a2), _mm256_set1_ps(kAtan3));
+  t = _mm256_add_ps(_mm256_mul_ps(t, a2), _mm256_set1_ps(kAtan1));
+  t = _mm256_mul_ps(t, a);
+
+  const auto pi = _mm256_set1_ps(kPiF);
+  t = _mm256_blendv_ps(t,
+                       _mm256_sub_ps(_mm256_set1_ps(kPiF / 2), t),
+                       _mm256_cmp_ps(ay, ax, _CMP_GT_OQ));
+  t = _mm256_blendv_ps(
+      t, _mm256_sub_ps(pi, t), _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ));
+  // copysign(t, y)
+  return _mm256_or_ps(_mm256_andnot_ps(sign, t), _mm256_and_ps(sign, y));
+}
+
+__attribute__((target("avx2"))) void ForwardFastAvx2(const LidarModel& model,
+                                                     const float* xs,
+                                                     const float* ys,
+                                                     const float* zs,
+                                                     int n,
+                                                     cv::Point* pxs) {
+  const auto zero = _mm256_setzero_ps();
+  const auto sign = _mm256_set1_ps(-0.0F);
+  const auto pi = _mm256_set1_ps(kPiF);
+  const auto elev_max = _mm256_set1_ps(model.elev_max);
+  const auto elev_delta = _mm256_set1_ps(model.elev_delta);
+  const auto azim_delta = _mm256_set1_ps(model.azim_delta);
+  const auto rows = _mm256_set1_ps(static_cast<float>(model.size.height));
+  const auto cols = _mm256_set1_ps(static_cast<float>(model.size.width));
+  const auto bad = _mm256_set1_epi32(-1);
+
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const auto x = _mm256_loadu_ps(xs + i);
+    const auto y = _mm256_loadu_ps(ys + i);
+    const auto z = _mm256_loadu_ps(zs + i);
+    const auto rxy2 = _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y));
+    const auto r2 = _mm256_add_ps(rxy2, _mm256_mul_ps(z, z));
+
+    const auto elev = Atan2Avx2(z, _mm256_sqrt_ps(rxy2));
+    const auto row = _mm256_round_ps(
+        _mm256_div_ps(_mm256_sub_ps(elev_max, elev), elev_delta),
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    const auto azim = _mm256_add_ps(Atan2Avx2(y, _mm256_xor_ps(x, sign)), pi);
+    const auto col = _mm256_div_ps(azim, azim_delta);
+
+    // Check in float, which also rejects nan
+    auto ok = _mm256_cmp_ps(r2, zero, _CMP_GT_OQ);
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(row, zero, _CMP_GE_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(row, rows, _CMP_LT_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(col, zero, _CMP_GE_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(col, cols, _CMP_LT_OQ));
+    const auto oki = _mm256_castps_si256(ok);
+    const auto ci = _mm256_blendv_epi8(bad, _mm256_cvttps_epi32(col), oki);
+    const auto ri = _mm256_blendv_epi8(bad, _mm256_cvttps_epi32(row), oki);
+
+    // Interleave into 8 cv::Point (col, row)
+    const auto lo = _mm256_unpacklo_epi32(ci, ri);  // 0 1 | 4 5
+    const auto hi = _mm256_unpackhi_epi32(ci, ri);  // 2 3 | 6 7
+    auto* out = reinterpret_cast<__m256i*>(pxs + i);
+    _mm256_storeu_si256(out, _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(lo, hi, 0x31));
+  }
+
+  // Remaining points if n is not a multiple of 8
+  ForwardFastScalar(model, xs + i, ys + i, zs + i, n - i, pxs + i);
+}
+#endif
+
+}  // namespace
+
+std::string Repr(SimdLevel level) {
+  switch (level) {
+    case SimdLevel::kScalar:
+      return "scalar";
+    case SimdLevel::kAvx2:
+      return "avx2";
+    default:
+      return "unknown";
+  }
+}
+
+SimdLevel GetSimdLevel() {
+  static const SimdLevel level = [] {
+#if defined(__AVX2__)
+    // Built with BUILD_MARCH_NATIVE (or -mavx2), no need to check at runtime
+    return SimdLevel::kAvx2;
+#elif defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::kAvx2;
+#endif
+    return SimdLevel::kScalar;
+  }();
+  return level;
+}
+
+std::string Repr(ProjMode mode) {
+  switch (mode) {
+    case ProjMode::kExact:
+      return "exact";
+    case ProjMode::kFast:
+      return "fast";
+    default:
+      return "unknown";
+  }
+}
+
 /// LidarModel =================================================================
 LidarModel::LidarModel(const cv::Size& size_in, float vfov) : size{size_in} {
   if (vfov <= 0) {
@@ -61,24 +241,64 @@ int LidarModel::ToCol(float x, float y) const {
   return static_cast<int>(azim / azim_delta);
 }
 
-// cv::Point2f LidarModel::ForwardF(float x, float y, float z, float r) const {
-//  cv::Point2f bad{-1.0F, -1.0F};
-//  const auto row = ToRowF(z, r);
-//  if (!RowInside(row)) return bad;
-//  const auto col = ToColF(x, y);
-//  if (!ColInside(col)) return bad;
-//  return {col, row};
-//}
-
-// float LidarModel::ToRowF(float z, float r) const {
-//  const float elev = std::asin(z / r);
-//  return (elev_max - elev) / elev_delta;
-//}
-
-// float LidarModel::ToColF(float x, float y) const {
-//  const float azim = std::atan2(y, -x) + kPiF;
-//  return azim / azim_delta;
-//}
+void LidarModel::ForwardBatch(const float* xs,
+                              const float* ys,
+                              const float* zs,
+                              int n,
+                              cv::Point* pxs,
+                              ProjMode mode,
+                              SimdLevel level) const {
+  if (mode == ProjMode::kExact) {
+    for (int i = 0; i < n; ++i) {
+      const auto r = std::sqrt(xs[i] * xs[i] + ys[i] * ys[i] + zs[i] * zs[i]);
+      // Forward() does not handle zero or nan range
+      pxs[i] = r > 0 ? Forward(xs[i], ys[i], zs[i], r) : cv::Point{-1, -1};
+    }
+    return;
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  if (level == SimdLevel::kAvx2) {
+    ForwardFastAvx2(*this, xs, ys, zs, n, pxs);
+    return;
+  }
+#endif
+  ForwardFastScalar(*this, xs, ys, zs, n, pxs);
+}
+
+cv::Mat MakeBeams(const LidarModel& model) {
+  cv::Mat beams(model.size, CV_32FC3);
+  for (int r = 0; r < model.size.height; ++r) {
+    auto* prow = beams.ptr<cv::Point3f>(r);
+    for (int c = 0; c < model.size.width; ++c) {
+      prow[c] = model.Backward(r, c);
+    }
+  }
+  return beams;
+}
+
+cv::Mat MakeBeams(const cv::Size& size,
+                  const std::vector<double>& altitudes,
+                  const std::vector<double>& azimuths) {
+  CHECK_EQ(static_cast<int>(altitudes.size()), size.height);
+  CHECK_EQ(static_cast<int>(azimuths.size()), size.height);
+
+  cv::Mat beams(size, CV_32FC3);
+  for (int r = 0; r < size.height; ++r) {
+    const double elev = Deg2Rad(altitudes[r]);
+    // Beam azimuth is an offset against the direction of the encoder
+    const double azim_offset = -Deg2Rad(azimuths[r]);
+    auto* prow = beams.ptr<cv::Point3f>(r);
+    for (int c = 0; c < size.width; ++c) {
+      const double azim = 2 * M_PI * (1.0 - static_cast<double>(c) / size.width) +
+                          azim_offset;
+      prow[c] = {static_cast<float>(std::cos(elev) * std::cos(azim)),
+                 static_cast<float>(std::cos(elev) * std::sin(azim)),
+                 static_cast<float>(std::sin(elev))};
+    }
+  }
+  return beams;
+}
 
 std::string LidarModel::Repr() const {
   return fmt::format(
@@ -1,11 +1,31 @@
 #pragma once
 
+#include <opencv2/core/mat.hpp>
 #include <opencv2/core/types.hpp>
 
 #include "sv/util/math.h"  // SinCosF
 
 namespace sv {
 
+/// @brief Instruction set used by vectorized kernels
+enum class SimdLevel {
+  kScalar,  // portable fallback
+  kAvx2,    // 8 lanes per step
+};
+
+std::string Repr(SimdLevel level);
+
+/// @brief Best simd level supported by this cpu, detected once at runtime
+SimdLevel GetSimdLevel();
+
+/// @brief Accuracy of LidarModel::ForwardBatch()
+enum class ProjMode {
+  kExact,  // std::asin and std::atan2, same pixels as Forward()
+  kFast,   // polynomial atan (err < 1e-5 rad), may differ by 1 at pixel border
+};
+
+std::string Repr(ProjMode mode);
+
 /// @struct LidarModel
 struct LidarModel {
   LidarModel() = default;
@@ -26,9 +46,15 @@ struct LidarModel {
   int ToRow(float z, float r) const;
   int ToCol(float x, float y) const;
 
-  //  cv::Point2f ForwardF(float x, float y, float z, float r) const;
-  //  float ToRowF(float z, float r) const;
-  //  float ToColF(float x, float y) const;
+  /// @brief Project n points given as separate x, y, z arrays to pxs, range
+  /// is computed from xyz, bad result is {-1, -1}
+  void ForwardBatch(const float* xs,
+                    const float* ys,
+                    const float* zs,
+                    int n,
+                    cv::Point* pxs,
+                    ProjMode mode = ProjMode::kExact,
+                    SimdLevel level = GetSimdLevel()) const;
 
   /// @brief Check if r/c inside image
   bool RowInside(float r) const noexcept { return 0 <= r && r < size.height; }
@@ -43,4 +69,15 @@ struct LidarModel {
   std::vector<SinCosF> azims{};
 };
 
+/// @brief Unit beam direction of every pixel (32FC3) of a uniform model
+cv::Mat MakeBeams(const LidarModel& model);
+
+/// @brief Unit beam direction of every pixel (32FC3) from per beam altitude and
+/// azimuth offset angles [deg] in sensor metadata (e.g. ouster
+/// beam_altitude_angles and beam_azimuth_angles), where col c is measured at
+/// encoder angle 2pi * (1 - c / width)
+cv::Mat MakeBeams(const cv::Size& size,
+                  const std::vector<double>& altitudes,
+                  const std::vector<double>& azimuths);
+
 }  // namespace sv
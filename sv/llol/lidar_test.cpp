@@ -1,8 +1,11 @@
 #include "sv/llol/lidar.h"
 
+#include <benchmark/benchmark.h>
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
+#include <random>
+
 namespace sv {
 namespace {
 
@@ -118,5 +121,161 @@ TEST(LidarTest, TestToCol) {
   EXPECT_EQ(lm.ToCol(1.0, 1.0), 7);
 }
 
+TEST(LidarTest, TestMakeBeams) {
+  const cv::Size size{8, 2};
+  const std::vector<double> altitudes{10.0, -10.0};
+
+  // Without azimuth offset, col c is at encoder angle 2pi * (1 - c / width)
+  const auto beams0 = MakeBeams(size, altitudes, {0.0, 0.0});
+  EXPECT_EQ(beams0.type(), CV_32FC3);
+  EXPECT_EQ(beams0.size(), size);
+  const auto& b00 = beams0.at<cv::Point3f>(0, 0);
+  EXPECT_FLOAT_EQ(b00.x, std::cos(Deg2Rad(10.0F)));
+  EXPECT_NEAR(b00.y, 0.0F, 1e-6);
+  EXPECT_FLOAT_EQ(b00.z, std::sin(Deg2Rad(10.0F)));
+  const auto& b12 = beams0.at<cv::Point3f>(1, 2);
+  EXPECT_NEAR(b12.x, 0.0F, 1e-6);
+  EXPECT_FLOAT_EQ(b12.y, -std::cos(Deg2Rad(10.0F)));
+  EXPECT_FLOAT_EQ(b12.z, -std::sin(Deg2Rad(10.0F)));
+
+  // An azimuth offset of one col in row 1 is the same as the next col
+  const auto beams1 = MakeBeams(size, altitudes, {0.0, 360.0 / size.width});
+  for (int c = 0; c + 1 < size.width; ++c) {
+    const auto& p0 = beams0.at<cv::Point3f>(1, c + 1);
+    const auto& p1 = beams1.at<cv::Point3f>(1, c);
+    EXPECT_NEAR(p0.x, p1.x, 1e-6) << c;
+    EXPECT_NEAR(p0.y, p1.y, 1e-6) << c;
+    EXPECT_NEAR(p0.z, p1.z, 1e-6) << c;
+    EXPECT_EQ(beams0.at<cv::Point3f>(0, c), beams1.at<cv::Point3f>(0, c));
+  }
+
+  // Uniform model gives the same directions as Backward()
+  const LidarModel lm{{32, 8}};
+  const auto beams2 = MakeBeams(lm);
+  EXPECT_EQ(beams2.at<cv::Point3f>(3, 5), lm.Backward(3, 5));
+}
+
+/// @brief Random points inside the vertical fov of model, as x, y, z planes
+std::vector<std::vector<float>> MakeRandomPoints(const LidarModel& lm, int n) {
+  std::mt19937 gen{42};
+  std::uniform_real_distribution<float> dist_rg{1.0F, 50.0F};
+  std::uniform_real_distribution<float> dist_elev{-lm.elev_max, lm.elev_max};
+  std::uniform_real_distribution<float> dist_azim{-kPiF, kPiF};
+
+  std::vector<std::vector<float>> xyzs(3, std::vector<float>(n));
+  for (int i = 0; i < n; ++i) {
+    const float rg = dist_rg(gen);
+    const float elev = dist_elev(gen);
+    const float azim = dist_azim(gen);
+    xyzs[0][i] = rg * std::cos(elev) * std::cos(azim);
+    xyzs[1][i] = rg * std::cos(elev) * std::sin(azim);
+    xyzs[2][i] = rg * std::sin(elev);
+  }
+  return xyzs;
+}
+
+TEST(LidarTest, TestForwardBatch) {
+  const LidarModel lm{{1024, 64}};
+  // Odd size to also exercise the scalar tail of simd kernels
+  const int n = 10001;
+  auto xyzs = MakeRandomPoints(lm, n);
+  // Nan and zero are bad
+  xyzs[0][0] = kNaNF;
+  xyzs[0][1] = xyzs[1][1] = xyzs[2][1] = 0.0F;
+
+  std::vector<cv::Point> pxs0(n);
+  lm.ForwardBatch(xyzs[0].data(),
+                  xyzs[1].data(),
+                  xyzs[2].data(),
+                  n,
+                  pxs0.data(),
+                  ProjMode::kExact);
+  EXPECT_EQ(pxs0[0], cv::Point(-1, -1));
+  EXPECT_EQ(pxs0[1], cv::Point(-1, -1));
+  for (int i = 2; i < n; ++i) {
+    const float x = xyzs[0][i];
+    const float y = xyzs[1][i];
+    const float z = xyzs[2][i];
+    const float r = std::sqrt(x * x + y * y + z * z);
+    ASSERT_EQ(pxs0[i], lm.Forward(x, y, z, r)) << i;
+  }
+
+  for (int l = 0; l <= static_cast<int>(GetSimdLevel()); ++l) {
+    const auto level = static_cast<SimdLevel>(l);
+    std::vector<cv::Point> pxs1(n);
+    lm.ForwardBatch(xyzs[0].data(),
+                    xyzs[1].data(),
+                    xyzs[2].data(),
+                    n,
+                    pxs1.data(),
+                    ProjMode::kFast,
+                    level);
+    EXPECT_EQ(pxs1[0], cv::Point(-1, -1));
+    EXPECT_EQ(pxs1[1], cv::Point(-1, -1));
+
+    // Fast mode only differs from exact close to pixel borders
+    int num_diff = 0;
+    for (int i = 0; i < n; ++i) {
+      if (pxs0[i] == pxs1[i]) continue;
+      ++num_diff;
+      if (pxs0[i].x < 0 || pxs1[i].x < 0) continue;  // border of image
+      EXPECT_LE(std::abs(pxs0[i].x - pxs1[i].x), 1) << Repr(level) << " " << i;
+      EXPECT_LE(std::abs(pxs0[i].y - pxs1[i].y), 1) << Repr(level) << " " << i;
+    }
+    EXPECT_LT(num_diff, n / 100) << Repr(level);
+  }
+}
+
+void BM_LidarForward(benchmark::State& state) {
+  const LidarModel lm{{1024, 64}};
+  const int n = 1024 * 64;
+  const auto xyzs = MakeRandomPoints(lm, n);
+  std::vector<cv::Point> pxs(n);
+
+  for (auto _ : state) {
+    for (int i = 0; i < n; ++i) {
+      const float x = xyzs[0][i];
+      const float y = xyzs[1][i];
+      const float z = xyzs[2][i];
+      pxs[i] = lm.Forward(x, y, z, std::sqrt(x * x + y * y + z * z));
+    }
+    benchmark::DoNotOptimize(pxs);
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_LidarForward);
+
+void BM_LidarForwardBatch(benchmark::State& state) {
+  const LidarModel lm{{1024, 64}};
+  const int n = 1024 * 64;
+  const auto xyzs = MakeRandomPoints(lm, n);
+  std::vector<cv::Point> pxs(n);
+  const auto mode = static_cast<ProjMode>(state.range(0));
+  const auto level = static_cast<SimdLevel>(state.range(1));
+  if (level > GetSimdLevel()) {
+    state.SkipWithError("Simd level not supported");
+    return;
+  }
+
+  for (auto _ : state) {
+    lm.ForwardBatch(xyzs[0].data(),
+                    xyzs[1].data(),
+                    xyzs[2].data(),
+                    n,
+                    pxs.data(),
+                    mode,
+                    level);
+    benchmark::DoNotOptimize(pxs);
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_LidarForwardBatch)
+    ->Args({static_cast<int>(ProjMode::kExact),
+            static_cast<int>(SimdLevel::kScalar)})
+    ->Args({static_cast<int>(ProjMode::kFast),
+            static_cast<int>(SimdLevel::kScalar)})
+    ->Args({static_cast<int>(ProjMode::kFast),
+            static_cast<int>(SimdLevel::kAvx2)});
+
 }  // namespace
 }  // namespace sv
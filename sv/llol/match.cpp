@@ -4,34 +4,69 @@
 
 namespace sv {
 
-void PointMatch::ResetGrid() {
-  px_g = {kBadPx, kBadPx};
+/// MatchRef ===================================================================
+void MatchRef::ResetGrid() {
+  px_g = {MatchTable::kBadPx, MatchTable::kBadPx};
   mc_g.Reset();
 }
 
-void PointMatch::ResetPano() {
-  px_p = {kBadPx, kBadPx};
+void MatchRef::ResetPano() {
+  px_p = {MatchTable::kBadPx, MatchTable::kBadPx};
   mc_p.Reset();
 }
 
-void PointMatch::Reset() {
+void MatchRef::Reset() {
   ResetGrid();
   ResetPano();
   U.setZero();
   scale = 0.0;
 }
 
-void PointMatch::CalcSqrtInfo(float lambda) {
+void MatchRef::CalcSqrtInfo(float lambda) {
   auto cov = mc_p.Covar();
   if (lambda > 0) cov.diagonal().array() += lambda;
   U = MatrixSqrtUtU(cov.inverse().eval());
 }
 
-void PointMatch::CalcSqrtInfo(const Eigen::Matrix3f& R_p_g, float lambda) {
+void MatchRef::CalcSqrtInfo(const Eigen::Matrix3f& R_p_g, float lambda) {
   auto cov = mc_p.Covar();
   cov.noalias() += R_p_g * mc_g.Covar() * R_p_g.transpose();
   if (lambda > 0) cov.diagonal().array() += lambda;
   U = MatrixSqrtUtU(cov.inverse().eval());
 }
 
+/// GridBits ===================================================================
+GridBits::GridBits(const cv::Size& size)
+    : size{size},
+      words_per_row{(size.width + kWordBits - 1) / kWordBits},
+      words(size.height * words_per_row, 0) {}
+
+int GridBits::Collect(std::vector<int>& inds) const {
+  inds.clear();
+
+  // Skip 64 unset bits at a time and jump to the next set bit
+  for (int r = 0; r < size.height; ++r) {
+    for (int w = 0; w < words_per_row; ++w) {
+      auto word = words[r * words_per_row + w];
+      const int i0 = r * size.width + w * kWordBits;
+      while (word != 0) {
+        inds.push_back(i0 + __builtin_ctzll(word));
+        word &= word - 1;  // clear lowest set bit
+      }
+    }
+  }
+  return static_cast<int>(inds.size());
+}
+
+/// MatchTable =================================================================
+MatchTable::MatchTable(const cv::Size& size)
+    : size{size},
+      px_g(size.area(), {kBadPx, kBadPx}),
+      mc_g(size.area()),
+      px_p(size.area(), {kBadPx, kBadPx}),
+      mc_p(size.area()),
+      U(size.area(), Eigen::Matrix3f::Zero()),
+      scale(size.area(), 0.0F),
+      valid(size) {}
+
 }  // namespace sv
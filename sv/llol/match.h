@@ -1,27 +1,69 @@
 #pragma once
 
 #include <opencv2/core/types.hpp>
+#include <type_traits>  // conditional_t
 
 #include "sv/util/math.h"  // MeanCovar
 
 namespace sv {
 
-/// @struct Match
-struct PointMatch {
-  static constexpr int kBadPx = -100;
+/// @struct Bitmask with one bit per grid cell, each row starts at a new word so
+/// that different rows can be updated concurrently
+struct GridBits {
+  static constexpr int kWordBits = 64;
+
+  cv::Size size{};
+  int words_per_row{};
+  std::vector<uint64_t> words;
+
+  GridBits() = default;
+  explicit GridBits(const cv::Size& size);
 
-  cv::Point px_g{kBadPx, kBadPx};  // 8 grid pixel coord
-  MeanCovar3f mc_g{};              // 52 grid mean covar
-  cv::Point px_p{kBadPx, kBadPx};  // 8 pano pixel coord
-  MeanCovar3f mc_p{};              // 52 pano mean covar
-  Eigen::Matrix3f U{};             // 36 sqrt of info
-  float scale{0.0};                // 4 scale of this match
+  bool Get(int i) const noexcept {
+    return (words[WordOf(i)] >> BitOf(i)) & 1U;
+  }
+  void Set(int i, bool b) noexcept {
+    const auto mask = uint64_t{1} << BitOf(i);
+    auto& word = words[WordOf(i)];
+    word = b ? (word | mask) : (word & ~mask);
+  }
+  void Clear() { std::fill(words.begin(), words.end(), 0); }
+
+  /// @brief Indices of all set bits in increasing order
+  /// @return Number of set bits
+  int Collect(std::vector<int>& inds) const;
+
+  /// @brief Location of bit i in words
+  int WordOf(int i) const noexcept {
+    return (i / size.width) * words_per_row + (i % size.width) / kWordBits;
+  }
+  int BitOf(int i) const noexcept { return (i % size.width) % kWordBits; }
+};
+
+/// @struct Reference to a match stored in MatchTable, with the same fields as
+/// a standalone match, kConst for read only access
+template <bool kConst>
+struct MatchRefBase {
+  template <typename T>
+  using Ref = std::conditional_t<kConst, const T&, T&>;
+
+  Ref<cv::Point> px_g;     // grid pixel coord
+  Ref<MeanCovar3f> mc_g;   // grid mean covar
+  Ref<cv::Point> px_p;     // pano pixel coord
+  Ref<MeanCovar3f> mc_p;   // pano mean covar
+  Ref<Eigen::Matrix3f> U;  // sqrt of info
+  Ref<float> scale;        // scale of this match
 
   /// @brief Whether this match is good
   bool Ok() const noexcept { return GridOk() && PanoOk(); }
   bool GridOk() const { return px_g.x >= 0 && mc_g.ok(); }
   bool PanoOk() const { return px_p.x >= 0 && mc_p.ok(); }
+};
 
+using MatchCRef = MatchRefBase<true>;
+
+/// @struct Mutable reference to a match stored in MatchTable
+struct MatchRef final : public MatchRefBase<false> {
   void ResetGrid();
   void ResetPano();
   void Reset();
@@ -30,4 +72,41 @@ struct PointMatch {
   void CalcSqrtInfo(const Eigen::Matrix3f& R_p_g, float lambda = 0.0F);
 };
 
+/// @struct Structure-of-arrays storage of one match per grid cell, so that
+/// each stage only pulls the fields it needs through cache
+struct MatchTable {
+  static constexpr int kBadPx = -100;
+
+  cv::Size size{};
+  std::vector<cv::Point> px_g;     // grid pixel coord
+  std::vector<MeanCovar3f> mc_g;   // grid mean covar
+  std::vector<cv::Point> px_p;     // pano pixel coord
+  std::vector<MeanCovar3f> mc_p;   // pano mean covar
+  std::vector<Eigen::Matrix3f> U;  // sqrt of info
+  std::vector<float> scale;        // scale of each match
+  GridBits valid;                  // good matches, see SetValid()
+
+  MatchTable() = default;
+  explicit MatchTable(const cv::Size& size);
+
+  /// @brief Info
+  int total() const noexcept { return size.area(); }
+  bool empty() const noexcept { return total() == 0; }
+
+  /// @brief At
+  MatchRef At(int i) {
+    return {{px_g[i], mc_g[i], px_p[i], mc_p[i], U[i], scale[i]}};
+  }
+  MatchCRef At(int i) const {
+    return {px_g[i], mc_g[i], px_p[i], mc_p[i], U[i], scale[i]};
+  }
+
+  /// @brief Whether match i is good, set by GicpSolver::Match()
+  bool IsValid(int i) const noexcept { return valid.Get(i); }
+  void SetValid(int i, bool ok) noexcept { valid.Set(i, ok); }
+  /// @brief Indices of all valid matches in increasing order
+  /// @return Number of valid matches
+  int GetValid(std::vector<int>& inds) const { return valid.Collect(inds); }
+};
+
 }  // namespace sv
@@ -3,8 +3,14 @@
 #include <fmt/core.h>
 #include <glog/logging.h>
 #include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
 #include <tbb/parallel_reduce.h>
 
+#include <algorithm>  // max
+#include <array>
+#include <cstring>  // memcpy
+#include <thread>   // yield
+
 #include <opencv2/core.hpp>
 
 #include "sv/util/ocv.h"  // Repr
@@ -13,6 +19,94 @@ namespace sv {
 
 using Vector3f = Eigen::Vector3f;
 
+namespace {
+
+/// @brief DepthPixel is 4 bytes (and 4-byte aligned in a cv::Mat), so it can
+/// be updated atomically as a single word
+uint32_t ToWord(const DepthPixel& dp) {
+  uint32_t w;
+  std::memcpy(&w, &dp, sizeof(w));
+  return w;
+}
+
+DepthPixel FromWord(uint32_t w) {
+  DepthPixel dp;
+  std::memcpy(&dp, &w, sizeof(w));
+  return dp;
+}
+
+DepthPixel AtomicLoad(const DepthPixel& dp) {
+  const auto* word = reinterpret_cast<const uint32_t*>(&dp);
+  return FromWord(__atomic_load_n(word, __ATOMIC_RELAXED));
+}
+
+/// @brief Replace dp with desired if it is still expected, otherwise expected
+/// is updated to the current value of dp
+bool AtomicCas(DepthPixel& dp,
+               DepthPixel& expected,
+               const DepthPixel& desired) {
+  auto* word = reinterpret_cast<uint32_t*>(&dp);
+  auto w = ToWord(expected);
+  const bool ok = __atomic_compare_exchange_n(
+      word, &w, ToWord(desired), true, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  if (!ok) expected = FromWord(w);
+  return ok;
+}
+
+/// @brief Cols of row sr in sweep that hold scan cols curr, these are about to
+/// be overwritten. With destagger the row is shifted and may wrap around, then
+/// the second range is not empty
+std::array<cv::Range, 2> RowCols(const LidarSweep& sweep,
+                                 const cv::Range& curr,
+                                 int sr) {
+  const int start = (curr.start + sweep.ShiftAt(sr)) % sweep.cols();
+  const int end = start + curr.size();
+  if (end <= sweep.cols()) return {cv::Range{start, end}, cv::Range{0, 0}};
+  return {cv::Range{start, sweep.cols()}, cv::Range{0, end - sweep.cols()}};
+}
+
+/// @brief Points waiting to be projected with LidarModel::ForwardBatch(), each
+/// with its range and a tag. Flush() calls f(px, rg, tag) on the points that
+/// land inside the pano
+struct ProjBatch {
+  static constexpr int kSize = 64;
+
+  const LidarModel& model;
+  ProjMode mode;
+  int n{};
+  float xs[kSize];
+  float ys[kSize];
+  float zs[kSize];
+  float rgs[kSize];
+  int tags[kSize];
+  cv::Point pxs[kSize];
+
+  ProjBatch(const LidarModel& lm, ProjMode pm) : model{lm}, mode{pm} {}
+
+  template <typename F>
+  void Push(const Vector3f& pt, float rg, int tag, F&& f) {
+    xs[n] = pt.x();
+    ys[n] = pt.y();
+    zs[n] = pt.z();
+    rgs[n] = rg;
+    tags[n] = tag;
+    if (++n == kSize) Flush(f);
+  }
+
+  template <typename F>
+  void Flush(F&& f) {
+    if (n == 0) return;
+    model.ForwardBatch(xs, ys, zs, n, pxs, mode);
+    for (int i = 0; i < n; ++i) {
+      if (pxs[i].x < 0 || pxs[i].y < 0) continue;
+      f(pxs[i], rgs[i], tags[i]);
+    }
+    n = 0;
+  }
+};
+
+}  // namespace
+
 DepthPano::DepthPano(const cv::Size& size, const PanoParams& params)
     : max_cnt{params.max_cnt},
       min_sweeps{params.min_sweeps},
@@ -23,6 +117,8 @@ DepthPano::DepthPano(const cv::Size& size, const PanoParams& params)
       align_gravity{params.align_gravity},
       min_match_ratio{params.min_match_ratio},
       max_translation{params.max_translation},
+      cache_xyz{params.cache_xyz},
+      proj_mode{params.proj_mode},
       model{size, params.vfov},
       dbuf{size, CV_16UC2},
       dbuf2{size, CV_16UC2} {
@@ -30,13 +126,15 @@ DepthPano::DepthPano(const cv::Size& size, const PanoParams& params)
   CHECK_LE(0, min_range);
   CHECK_LT(min_range, max_range);
   CHECK_LE(max_range, DepthPixel::kMaxRange);
+  Reset();
 }
 
 std::string DepthPano::Repr() const {
   return fmt::format(
       "DepthPano(max_cnt={}, min_sweeps={}, min_range={}, max_range={}, "
       "win_ratio={}, fuse_ratio={}, match_ratio={}, align_gravity={}, "
-      "max_translation={}, model={}, dbuf={}, pixel=(scale={}, max_range={})",
+      "max_translation={}, cache_xyz={}, proj_mode={}, model={}, dbuf={}, "
+      "pixel=(scale={}, max_range={})",
       max_cnt,
       min_sweeps,
       min_range,
@@ -46,12 +144,19 @@ std::string DepthPano::Repr() const {
       min_match_ratio,
       align_gravity,
       max_translation,
+      cache_xyz,
+      sv::Repr(proj_mode),
       model.Repr(),
       sv::Repr(dbuf),
       DepthPixel::kScale,
       DepthPixel::kMaxRange);
 }
 
+void DepthPano::Reset(const cv::Scalar& pixel) {
+  dbuf.setTo(pixel);
+  if (cache_xyz) CalcXyz(dbuf, xbuf);
+}
+
 int DepthPano::Add(const LidarSweep& sweep, const cv::Range& curr, int gsize) {
   gsize = gsize <= 0 ? sweep.rows() : gsize;
 
@@ -70,33 +175,158 @@ int DepthPano::Add(const LidarSweep& sweep, const cv::Range& curr, int gsize) {
       std::plus<>{});
 }
 
-int DepthPano::AddRow(const LidarSweep& sweep, const cv::Range& curr, int sr) {
-  int n = 0;
+template <typename F>
+void DepthPano::ForEachPoint(const LidarSweep& sweep,
+                             const cv::Range& cols,
+                             int sr,
+                             F&& f) const {
+  // Cols are in sweep, which are shifted from scan cols if destaggered, so the
+  // pose of each point is looked up by PoseCol()
+  const auto visit = [&](int sc, const Vector3f& pt_s) {
+    const Vector3f pt_p = sweep.TransformAt(sweep.PoseCol(sc, sr), pt_s);
+    const auto rg_p = pt_p.norm();
+    // Ignore too far and too close stuff, same as AddPoint()
+    if (rg_p < min_range || rg_p > max_range) return;
+    f(pt_p, rg_p);
+  };
+
+  if (sweep.layout == ScanLayout::kPlanar) {
+    // Fast path, read xyz planes directly
+    const auto* xs = sweep.XyzRow(0, sr);
+    const auto* ys = sweep.XyzRow(1, sr);
+    const auto* zs = sweep.XyzRow(2, sr);
+    for (int sc = cols.start; sc < cols.end; ++sc) {
+      if (std::isnan(xs[sc])) continue;
+      visit(sc, Vector3f{xs[sc], ys[sc], zs[sc]});
+    }
+    return;
+  }
+
+  if (sweep.layout == ScanLayout::kCompact) {
+    // Fast path, reconstruct xyz from range along beam directions
+    const auto* ranges = sweep.range.ptr<uint16_t>(sr);
+    const auto scale = static_cast<float>(sweep.scale);
+    for (int sc = cols.start; sc < cols.end; ++sc) {
+      if (ranges[sc] == 0) continue;
+      visit(sc, sweep.BeamAt({sc, sr}) * (ranges[sc] / scale));
+    }
+    return;
+  }
 
-  for (int sc = curr.start; sc < curr.end; ++sc) {
+  for (int sc = cols.start; sc < cols.end; ++sc) {
     const auto& pixel_s = sweep.PixelAt({sc, sr});
     if (!pixel_s.Ok()) continue;
+    visit(sc, pixel_s.Vec3fMap());
+  }
+}
 
-    // Transform into pano frame
-    const auto pt_p = sweep.TfAt(sc) * pixel_s.Vec3fMap();
-    const auto rg_p = pt_p.norm();
-
-    // Ignore too far and too close stuff
-    if (rg_p < min_range || rg_p > max_range) continue;
-
-    // Project to pano
-    const auto px_p = model.Forward(pt_p.x(), pt_p.y(), pt_p.z(), rg_p);
-    if (px_p.x < 0 || px_p.y < 0) continue;
+int DepthPano::AddRow(const LidarSweep& sweep, const cv::Range& curr, int sr) {
+  // With destagger, row sr of curr is stored shifted (and maybe wrapped) in
+  // sweep, so we add the cols that are about to be overwritten
+  int n = 0;
+  for (const auto& cols : RowCols(sweep, curr, sr)) {
+    n += AddCols(sweep, cols, sr);
+  }
+  return n;
+}
 
+int DepthPano::AddCols(const LidarSweep& sweep,
+                       const cv::Range& cols,
+                       int sr) {
+  int n = 0;
+  const auto fuse = [&](const cv::Point& px_p, float rg_p, int) {
     n += static_cast<int>(FuseDepth(px_p, rg_p));
+  };
+
+  // Points of all layouts are projected in batches
+  ProjBatch batch{model, proj_mode};
+  ForEachPoint(sweep, cols, sr, [&](const Vector3f& pt_p, float rg_p) {
+    batch.Push(pt_p, rg_p, 0, fuse);
+  });
+  batch.Flush(fuse);
+  return n;
+}
+
+void DepthPano::GetPoints(const LidarSweep& sweep,
+                          const cv::Range& curr,
+                          std::vector<Vector3f>& pts) const {
+  for (int sr = 0; sr < sweep.rows(); ++sr) {
+    for (const auto& cols : RowCols(sweep, curr, sr)) {
+      ForEachPoint(sweep, cols, sr, [&](const Vector3f& pt_p, float) {
+        pts.push_back(pt_p);
+      });
+    }
   }
+}
 
-  return n;
+bool DepthPano::AddPoint(const Vector3f& pt_p) {
+  const auto rg_p = pt_p.norm();
+
+  // Ignore too far and too close stuff
+  if (rg_p < min_range || rg_p > max_range) return false;
+
+  // Project to pano
+  const auto px_p = model.Forward(pt_p.x(), pt_p.y(), pt_p.z(), rg_p);
+  if (px_p.x < 0 || px_p.y < 0) return false;
+
+  return FuseDepth(px_p, rg_p);
 }
 
 bool DepthPano::FuseDepth(const cv::Point& px, float rg) {
-  auto& pixel = PixelAt(px);
+  // Rows of a sweep are added in parallel and may land on the same pixel, so
+  // we fuse into a copy and only write it back if no other row has changed
+  // the pixel in between, otherwise retry with its new value
+  auto& dp = PixelAt(px);
+  auto old = AtomicLoad(dp);
+  while (true) {
+    auto pixel = old;
+    const bool ok = FusePixel(pixel, rg);
+    if (!AtomicCas(dp, old, pixel)) continue;
+    // xyz only depends on range, so skip it if only cnt changed
+    if (cache_xyz && pixel.raw != old.raw) SyncXyz(px, pixel.raw);
+    return ok;
+  }
+}
+
+void DepthPano::SyncXyz(const cv::Point& px, uint16_t raw) {
+  // Another row may change the range of this pixel while we write its xyz, and
+  // the three floats are not written atomically. So after writing we check
+  // the range again and rewrite if it changed. The fences make sure that
+  // whoever writes last has seen the final range
+  auto& pt = xbuf.at<cv::Point3f>(px);
+  const auto& dp = PixelAt(px);
+  while (true) {
+    const auto xyz = model.Backward(px.y, px.x, raw / DepthPixel::kScale);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    __atomic_store(&pt.x, &xyz.x, __ATOMIC_RELAXED);
+    __atomic_store(&pt.y, &xyz.y, __ATOMIC_RELAXED);
+    __atomic_store(&pt.z, &xyz.z, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    const auto curr = AtomicLoad(dp).raw;
+    if (curr == raw) return;
+    raw = curr;
+  }
+}
+
+void DepthPano::CalcXyz(const cv::Mat& buf, cv::Mat& xyz, int gsize) const {
+  CHECK_EQ(buf.size(), size());
+  xyz.create(buf.size(), CV_32FC3);
+  gsize = gsize <= 0 ? rows() : gsize;
+
+  tbb::parallel_for(tbb::blocked_range<int>(0, rows(), gsize),
+                    [&](const auto& blk) {
+                      for (int r = blk.begin(); r < blk.end(); ++r) {
+                        const auto* pixels = buf.ptr<DepthPixel>(r);
+                        auto* pts = xyz.ptr<cv::Point3f>(r);
+                        for (int c = 0; c < cols(); ++c) {
+                          pts[c] = model.Backward(r, c, pixels[c].GetRange());
+                        }
+                      }
+                    });
+}
 
+bool DepthPano::FusePixel(DepthPixel& pixel, float rg) const {
   // If depth is 0, this is a new point and we give it a relatively large cnt
   if (pixel.raw == 0) {
     pixel.SetRangeCount(rg, max_cnt / 2);
@@ -155,33 +385,54 @@ bool DepthPano::ShouldRender(const Sophus::SE3d& tf_p2_p1,
 }
 
 int DepthPano::Render(Sophus::SE3f tf_p2_p1, int gsize) {
-  // clear pano2
-  dbuf2.setTo(0);
+  const int total = RenderTo(dbuf, tf_p2_p1, dbuf2, gsize);
+
+  cv::swap(dbuf, dbuf2);
+  // Each pixel of the new pano is computed once, instead of on every
+  // z-buffer update in RenderRow()
+  if (cache_xyz) CalcXyz(dbuf, xbuf, gsize);
+
+  // set number of sweeps to 1
+  num_sweeps = 1;
+  return total;
+}
+
+int DepthPano::RenderTo(const cv::Mat& src,
+                        const Sophus::SE3f& tf_p2_p1,
+                        cv::Mat& dst,
+                        int gsize) const {
+  CHECK_EQ(src.size(), size());
+  // clear dst
+  dst.create(src.size(), src.type());
+  dst.setTo(0);
   gsize = gsize <= 0 ? rows() : gsize;
 
-  const int total = tbb::parallel_reduce(
+  return tbb::parallel_reduce(
       tbb::blocked_range<int>(0, rows(), gsize),
       0,
       [&](const auto& blk, int n) {
         for (int r = blk.begin(); r < blk.end(); ++r) {
-          n += RenderRow(tf_p2_p1, r);
+          n += RenderRow(src, tf_p2_p1, r, dst);
         }
         return n;
       },
       std::plus<>{});
-
-  cv::swap(dbuf, dbuf2);
-
-  // set number of sweeps to 1
-  num_sweeps = 1;
-  return total;
 }
 
-int DepthPano::RenderRow(const Sophus::SE3f& tf_p2_p1, int r1) {
+int DepthPano::RenderRow(const cv::Mat& src,
+                         const Sophus::SE3f& tf_p2_p1,
+                         int r1,
+                         cv::Mat& dst) const {
   int n = 0;
+  const auto update = [&](const cv::Point& px2, float rg2, int cnt) {
+    // Check for occlusion
+    n += UpdateBuffer(dst, px2, rg2, cnt);
+  };
 
+  // xyz2 -> px2 is done in batches, count of each pixel goes along as tag
+  ProjBatch batch{model, proj_mode};
   for (int c1 = 0; c1 < cols(); ++c1) {
-    const auto& dp1 = PixelAt({c1, r1});
+    const auto& dp1 = src.at<DepthPixel>(r1, c1);
     // We skip pixel that is empty or uncertainy
     if (dp1.raw == 0 || dp1.cnt < max_cnt / 4) continue;
 
@@ -190,42 +441,44 @@ int DepthPano::RenderRow(const Sophus::SE3f& tf_p2_p1, int r1) {
     Eigen::Map<const Vector3f> pt1_map(&pt1.x);
 
     // xyz1 -> xyz2
-    const auto pt2 = tf_p2_p1 * pt1_map;
+    const Vector3f pt2 = tf_p2_p1 * pt1_map;
     const auto rg2 = pt2.norm();
 
     if (rg2 < min_range || rg2 > max_range) continue;
 
-    // xyz2 -> px2
-    const auto px2 = model.Forward(pt2.x(), pt2.y(), pt2.z(), rg2);
-    if (px2.x < 0) continue;
-
-    // Check for occlusion
-    n += UpdateBuffer(px2, rg2, dp1.cnt);
+    batch.Push(pt2, rg2, dp1.cnt, update);
   }
+  batch.Flush(update);
 
   return n;
 }
 
-bool DepthPano::UpdateBuffer(const cv::Point& px, float rg, int cnt) {
-  auto& pixel = dbuf2.at<DepthPixel>(px);
+bool DepthPano::UpdateBuffer(cv::Mat& dst,
+                             const cv::Point& px,
+                             float rg,
+                             int cnt) const {
+  // When rendering a new depth pano, if the original pixel is well estimated
+  // (high cnt), this means that it also has good visibility from the current
+  // viewpoint. On the other hand, if it has low cnt, this means that it was
+  // probably occluded. Therefore, we simply half the original cnt and make it
+  // the new one
+  DepthPixel pixel;
+  pixel.SetRangeCount(rg, cnt / 2);
 
   // if the destination pixel is empty, or the new rg is smaller than the old
-  // one, we update the depth
-  if (pixel.raw == 0 || rg < pixel.GetRange()) {
-    // When rendering a new depth pano, if the original pixel is well estimated
-    // (high cnt), this means that it also has good visibility from the current
-    // viewpoint. On the other hand, if it has low cnt, this means that it was
-    // probably occluded. Therefore, we simply half the original cnt and make it
-    // the new one
-    pixel.SetRangeCount(rg, cnt / 2);
-    return true;
+  // one, we update the depth. Several source rows may hit the same pixel, so
+  // this is an atomic min on the packed pixel
+  auto& dp = dst.at<DepthPixel>(px);
+  auto old = AtomicLoad(dp);
+  while (pixel.Occludes(old)) {
+    if (AtomicCas(dp, old, pixel)) return true;
   }
 
   return false;
 }
 
 float DepthPano::CalcMeanCovar(cv::Rect win, float rg, MeanCovar3f& mc) const {
-  mc.Reset();
+  MomentSum3f ms;
 
   // Make sure window is within bound
   win = win & cv::Rect{cv::Point{}, size()};
@@ -240,13 +493,21 @@ float DepthPano::CalcMeanCovar(cv::Rect win, float rg, MeanCovar3f& mc) const {
       // Check for validity and range similarity
       if (rg_w == 0 || (std::abs(rg_w - rg) / rg) > win_ratio) continue;
 
+      // Cache must follow dbuf, otherwise some writer skipped SyncXyz()
+      DCHECK(!cache_xyz ||
+             cv::norm(PointAt(px_w) - model.Backward(px_w.y, px_w.x, rg_w)) <=
+                 1e-4 * rg_w)
+          << px_w;
+
       // Add 3d point
-      const auto pt = model.Backward(px_w.y, px_w.x, rg_w);
-      mc.Add({pt.x, pt.y, pt.z});
+      const auto pt =
+          cache_xyz ? PointAt(px_w) : model.Backward(px_w.y, px_w.x, rg_w);
+      ms.Add({pt.x, pt.y, pt.z});
       weight += dp.cnt;
     }
   }
 
+  ms.Finalize(mc);
   return weight / max_cnt;
 }
 
@@ -262,4 +523,63 @@ const std::vector<cv::Mat>& DepthPano::DrawRangeCount2() const {
   return disp;
 }
 
+/// PanoRenderer ===============================================================
+void PanoRenderer::Start(const DepthPano& pano, const Sophus::SE3d& tf) {
+  CHECK(!started) << "Render already in flight";
+
+  // Snapshot so that pano can still be added to while rendering
+  pano.dbuf.copyTo(src);
+  tf_p2_p1 = tf;
+  total = 0;
+  start_sweeps = pano.num_sweeps;
+  pts.clear();
+  started = true;
+  finished.store(false);
+
+  arena.enqueue([this, &pano] {
+    total = pano.RenderTo(src, tf_p2_p1.cast<float>(), dst, gsize);
+    if (pano.cache_xyz) pano.CalcXyz(dst, xyz, gsize);
+    finished.store(true);
+  });
+}
+
+int PanoRenderer::Add(DepthPano& pano,
+                      const LidarSweep& sweep,
+                      const cv::Range& curr,
+                      int gsize) {
+  // Points must be read before Add() returns, since sweep is overwritten next
+  if (started) pano.GetPoints(sweep, curr, pts);
+  return pano.Add(sweep, curr, gsize);
+}
+
+void PanoRenderer::Wait() const {
+  while (started && !finished.load()) std::this_thread::yield();
+}
+
+int PanoRenderer::Finish(DepthPano& pano) {
+  CHECK(started) << "No render to finish";
+  Wait();
+
+  // Previous pano goes to dbuf2 for viz, and the old dbuf2 becomes dst of the
+  // next render
+  cv::swap(pano.dbuf, dst);
+  cv::swap(pano.dbuf2, dst);
+  if (pano.cache_xyz) cv::swap(pano.xbuf, xyz);
+
+  // Sweeps added since Start() only went into the previous pano, so they are
+  // moved to the new frame and fused again
+  const Sophus::SE3f tf = tf_p2_p1.cast<float>();
+  const int n = static_cast<int>(pts.size());
+  const int grain = gsize <= 0 ? std::max(n, 1) : gsize * pano.cols();
+  tbb::parallel_for(tbb::blocked_range<int>(0, n, grain), [&](const auto& blk) {
+    for (int i = blk.begin(); i < blk.end(); ++i) pano.AddPoint(tf * pts[i]);
+  });
+
+  num_replayed = pano.num_sweeps - start_sweeps;
+  pano.num_sweeps = 1 + num_replayed;
+  pts.clear();
+  started = false;
+  return total;
+}
+
 }  // namespace sv
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <tbb/task_arena.h>
+
+#include <atomic>
+
 #include "sv/llol/lidar.h"
 #include "sv/llol/sweep.h"
 
@@ -20,6 +24,19 @@ struct DepthPixel {
     SetRange(rg);
     cnt = static_cast<uint16_t>(n);
   }
+
+  /// @brief Whether this pixel wins the z-buffer test against rhs, closer
+  /// range first, then higher cnt, and empty pixels always lose. This is a
+  /// strict total order, so the result of rendering does not depend on the
+  /// order in which pixels are written
+  bool Occludes(const DepthPixel& rhs) const noexcept {
+    return ZKey() < rhs.ZKey();
+  }
+  /// @brief Range in the high bits and inverted cnt in the low bits
+  uint32_t ZKey() const noexcept {
+    if (raw == 0) return std::numeric_limits<uint32_t>::max();
+    return (uint32_t{raw} << 16U) | (kMaxRaw - cnt);
+  }
 } __attribute__((packed));
 static_assert(sizeof(DepthPixel) == 4, "Size of DepthPixel is not 4");
 
@@ -34,6 +51,8 @@ struct PanoParams {
   bool align_gravity{false};
   double min_match_ratio{0.9};
   double max_translation{1.5};
+  bool cache_xyz{false};
+  ProjMode proj_mode{ProjMode::kExact};
 };
 
 /// @class Depth Panorama
@@ -48,11 +67,14 @@ struct DepthPano {
   bool align_gravity{};
   double min_match_ratio{};
   double max_translation{};
+  bool cache_xyz{};
+  ProjMode proj_mode{};  // projection in AddCols() and RenderRow()
 
   /// Data
   LidarModel model;
   cv::Mat dbuf;
   cv::Mat dbuf2;
+  cv::Mat xbuf;  // xyz of each pixel in dbuf (32FC3), only if cache_xyz
   float num_sweeps{-1};  // number of sweeps added
 
   /// @brief Ctors
@@ -64,24 +86,68 @@ struct DepthPano {
     return os << rhs.Repr();
   }
 
+  /// @brief Set every pixel of dbuf to pixel (empty by default), and refresh
+  /// xbuf if cache_xyz, use this instead of writing dbuf directly
+  void Reset(const cv::Scalar& pixel = {});
+
   /// @brief At
   auto& PixelAt(const cv::Point& pt) { return dbuf.at<DepthPixel>(pt); }
   const auto& PixelAt(const cv::Point& pt) const {
     return dbuf.at<DepthPixel>(pt);
   }
   float RangeAt(const cv::Point& pt) const { return PixelAt(pt).GetRange(); }
+  /// @brief Cached xyz of pixel, only valid if cache_xyz
+  const auto& PointAt(const cv::Point& pt) const {
+    return xbuf.at<cv::Point3f>(pt);
+  }
 
   /// @brief Add a partial sweep to the pano
   int Add(const LidarSweep& sweep, const cv::Range& curr, int gsize = 0);
   int AddRow(const LidarSweep& sweep, const cv::Range& curr, int row);
+  /// @brief Add cols of a row in sweep, cols are already destaggered
+  int AddCols(const LidarSweep& sweep, const cv::Range& cols, int row);
+  /// @brief Call f(pt_p, rg_p) on every point in cols of a row in sweep that
+  /// is within range limits, pt_p is in pano frame
+  template <typename F>
+  void ForEachPoint(const LidarSweep& sweep,
+                    const cv::Range& cols,
+                    int row,
+                    F&& f) const;
+  /// @brief Append points of a partial sweep that Add() would fuse to pts, in
+  /// pano frame
+  void GetPoints(const LidarSweep& sweep,
+                 const cv::Range& curr,
+                 std::vector<Eigen::Vector3f>& pts) const;
+  /// @brief Add a point already in pano frame
+  bool AddPoint(const Eigen::Vector3f& pt_p);
+  /// @brief Lock-free fusion of rg into pixel px, safe to call on the same px
+  /// from multiple threads
   bool FuseDepth(const cv::Point& px, float rg);
+  /// @brief Fuse rg into pixel, which is a copy of a pano pixel
+  bool FusePixel(DepthPixel& pixel, float rg) const;
+  /// @brief Write xyz of raw range into xbuf at px, safe to call on the same
+  /// px from multiple threads
+  void SyncXyz(const cv::Point& px, uint16_t raw);
+  /// @brief Compute xyz of every pixel in buf (a pano buffer) into xyz
+  void CalcXyz(const cv::Mat& buf, cv::Mat& xyz, int gsize = 0) const;
 
   /// @brief Render pano at a new location
   /// @note frame difference, ones is T_p1_p2, the other is T_p2_p1
   bool ShouldRender(const Sophus::SE3d& tf_p2_p1, double match_ratio) const;
   int Render(Sophus::SE3f tf_p2_p1, int gsize = 0);
-  int RenderRow(const Sophus::SE3f& tf_p2_p1, int row);
-  bool UpdateBuffer(const cv::Point& px, float rg, int cnt);
+  /// @brief Render src (a pano buffer) into dst at a new location, does not
+  /// touch dbuf so it can run alongside Add()
+  int RenderTo(const cv::Mat& src,
+               const Sophus::SE3f& tf_p2_p1,
+               cv::Mat& dst,
+               int gsize = 0) const;
+  int RenderRow(const cv::Mat& src,
+                const Sophus::SE3f& tf_p2_p1,
+                int row,
+                cv::Mat& dst) const;
+  /// @brief Lock-free z-buffer test, safe to call on the same dst pixel from
+  /// multiple threads
+  bool UpdateBuffer(cv::Mat& dst, const cv::Point& px, float rg, int cnt) const;
 
   /// @brief info
   int rows() const { return dbuf.rows; }
@@ -100,4 +166,52 @@ struct DepthPano {
   const std::vector<cv::Mat>& DrawRangeCount2() const;
 };
 
+/// @struct Renders a snapshot of a DepthPano in a separate tbb arena, so that
+/// odometry can keep adding to and matching against the old pano meanwhile.
+/// Points added to the pano through Add() while rendering are kept, and
+/// Finish() replays them into the new pano at tf_p2_p1
+/// @note Start() and Finish() must be called from the same thread, and the
+/// pano must outlive the render in flight
+struct PanoRenderer {
+  int gsize{};                       // grain size of rows in render
+  cv::Mat src;                       // snapshot of pano dbuf taken by Start()
+  cv::Mat dst;                       // rendered pano, swapped in by Finish()
+  cv::Mat xyz;                       // xyz of dst, only if pano.cache_xyz
+  Sophus::SE3d tf_p2_p1{};           // frame difference of the render
+  int total{};                       // number of rendered pixels
+  float start_sweeps{};              // num_sweeps of pano at Start()
+  float num_replayed{};              // sweeps added while rendering
+  std::vector<Eigen::Vector3f> pts;  // points added while rendering, in p1
+  bool started{false};               // a render is in flight or not swapped
+  std::atomic_bool finished{false};  // set by render task when done
+  tbb::task_arena arena;
+
+  explicit PanoRenderer(int gsize = 0) : gsize{gsize} {}
+  ~PanoRenderer() noexcept { Wait(); }
+
+  PanoRenderer(const PanoRenderer&) = delete;
+  PanoRenderer& operator=(const PanoRenderer&) = delete;
+
+  /// @brief Whether a render is started and not yet swapped in
+  bool busy() const noexcept { return started; }
+  /// @brief Whether the render is done and can be swapped in without waiting
+  bool ready() const noexcept { return started && finished.load(); }
+
+  /// @brief Snapshot pano and render it at tf_p2_p1 in background
+  void Start(const DepthPano& pano, const Sophus::SE3d& tf);
+  /// @brief Add a partial sweep to pano, and keep its points for Finish() if a
+  /// render is in flight
+  int Add(DepthPano& pano,
+          const LidarSweep& sweep,
+          const cv::Range& curr,
+          int gsize = 0);
+  /// @brief Block until the render in flight (if any) is done
+  void Wait() const;
+  /// @brief Swap the rendered pano into pano, blocks if it is not done yet.
+  /// Like DepthPano::Render(), the previous pano is kept in pano.dbuf2.
+  /// Points added since Start() are then fused into the new pano
+  /// @return Number of rendered pixels
+  int Finish(DepthPano& pano);
+};
+
 }  // namespace sv
@@ -2,12 +2,38 @@
 
 #include <benchmark/benchmark.h>
 #include <gtest/gtest.h>
+#include <tbb/global_control.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+
+#include <random>
 
 #include "sv/llol/scan.h"  // MakeTestScan
 
 namespace sv {
 namespace {
 
+void ExpectSamePixels(const cv::Mat& dbuf0, const cv::Mat& dbuf1) {
+  ASSERT_EQ(dbuf0.size(), dbuf1.size());
+  for (int r = 0; r < dbuf0.rows; ++r) {
+    for (int c = 0; c < dbuf0.cols; ++c) {
+      const auto& p0 = dbuf0.at<DepthPixel>(r, c);
+      const auto& p1 = dbuf1.at<DepthPixel>(r, c);
+      ASSERT_EQ(p0.raw, p1.raw) << r << " " << c;
+      ASSERT_EQ(p0.cnt, p1.cnt) << r << " " << c;
+    }
+  }
+}
+
+/// @brief Run f in an arena of 4 threads even with fewer cores, so that
+/// parallel loops in f really run concurrently
+template <typename F>
+void RunConcurrently(F&& f) {
+  tbb::global_control gc{tbb::global_control::max_allowed_parallelism, 4};
+  tbb::task_arena arena{4};
+  arena.execute(std::forward<F>(f));
+}
+
 TEST(DepthPanoTest, TestCtor) {
   DepthPano dp{{1024, 256}};
   EXPECT_EQ(dp.cols(), 1024);
@@ -17,6 +43,306 @@ TEST(DepthPanoTest, TestCtor) {
   std::cout << dp << std::endl;
 }
 
+TEST(DepthPanoTest, TestAddLayout) {
+  const cv::Size size{1024, 64};
+  const auto packed = MakeTestSweep(size);
+  const auto planar = MakeTestSweep(size, ScanLayout::kPlanar);
+
+  DepthPano dp0{{1024, 256}};
+  DepthPano dp1{{1024, 256}};
+  const auto n0 = dp0.Add(packed, packed.curr);
+  EXPECT_GT(n0, 0);
+  EXPECT_EQ(n0, dp1.Add(planar, planar.curr));
+  for (int r = 0; r < dp0.rows(); ++r) {
+    for (int c = 0; c < dp0.cols(); ++c) {
+      EXPECT_EQ(dp0.PixelAt({c, r}).raw, dp1.PixelAt({c, r}).raw);
+    }
+  }
+
+  // Fast projection may move points on pixel borders to a neighbor
+  PanoParams pp;
+  pp.proj_mode = ProjMode::kFast;
+  DepthPano dp2{{1024, 256}, pp};
+  EXPECT_NEAR(dp2.Add(planar, planar.curr), n0, n0 * 1e-2);
+  int num_diff = 0;
+  for (int r = 0; r < dp0.rows(); ++r) {
+    for (int c = 0; c < dp0.cols(); ++c) {
+      num_diff += static_cast<int>(dp0.PixelAt({c, r}).raw !=
+                                   dp2.PixelAt({c, r}).raw);
+    }
+  }
+  EXPECT_LT(num_diff, n0 / 100);
+}
+
+TEST(DepthPanoTest, TestAddCompact) {
+  const cv::Size size{1024, 64};
+  LidarSweep packed(size);
+  packed.Add(MakeTestCompactScan(size));
+  const auto compact = MakeTestSweep(size, ScanLayout::kCompact);
+
+  // Reconstructed xyz may differ in the last bit, so points on pixel
+  // boundaries may round differently, allow a few
+  DepthPano dp0{{1024, 256}};
+  DepthPano dp1{{1024, 256}};
+  const auto n0 = dp0.Add(packed, packed.curr);
+  EXPECT_GT(n0, 0);
+  EXPECT_NEAR(dp1.Add(compact, compact.curr), n0, n0 * 1e-3);
+}
+
+TEST(DepthPanoTest, TestAddDestagger) {
+  const cv::Size size{1024, 64};
+  const auto sweep = MakeTestSweep(size);
+  auto shifted = sweep;
+  std::vector<int> shifts(size.height, 0);
+  for (int r = 0; r < size.height; ++r) shifts[r] = (r % 4) * 6;
+  shifted.SetShifts(shifts);
+
+  // Ejecting the whole sweep covers all cols of every row regardless of shift
+  DepthPano dp0{{1024, 256}};
+  DepthPano dp1{{1024, 256}};
+  EXPECT_EQ(dp0.Add(sweep, {0, size.width}), dp1.Add(shifted, {0, size.width}));
+
+  // Half sweeps wrap around for shifted rows
+  dp1.Reset();
+  int n1 = dp1.Add(shifted, {0, size.width / 2});
+  n1 += dp1.Add(shifted, {size.width / 2, size.width});
+  dp0.Reset();
+  EXPECT_EQ(dp0.Add(sweep, {0, size.width}), n1);
+}
+
+TEST(DepthPanoTest, TestAddDestaggerPose) {
+  const cv::Size size{1024, 64};
+  std::vector<int> shifts(size.height, 0);
+  for (int r = 0; r < size.height; ++r) shifts[r] = (r % 4) * 6;
+
+  // Col poses follow a non-constant trajectory, so a point only lands on the
+  // same pixel if it takes the pose of its scan col instead of its sweep col
+  const auto set_tfs = [](LidarSweep& sweep) {
+    for (int c = 0; c < sweep.cols(); ++c) {
+      const auto rot = Sophus::SO3f::exp(Eigen::Vector3f{0, 0, 1e-4F * c});
+      sweep.SetTfAt(c, Sophus::SE3f{rot, Eigen::Vector3f{1e-3F * c, 0, 0}});
+    }
+  };
+
+  for (const auto layout :
+       {ScanLayout::kPacked, ScanLayout::kPlanar, ScanLayout::kCompact}) {
+    const bool compact = layout == ScanLayout::kCompact;
+    const auto beams = compact ? MakeTestBeams(size) : cv::Mat{};
+    const auto scan = compact ? MakeTestCompactScan(size) : MakeTestScan(size);
+
+    LidarSweep sweep(size, layout, beams);
+    sweep.Add(scan);
+    set_tfs(sweep);
+    LidarSweep shifted(size, layout, beams);
+    shifted.SetShifts(shifts);
+    shifted.Add(scan);
+    set_tfs(shifted);
+
+    DepthPano dp0{{1024, 256}};
+    DepthPano dp1{{1024, 256}};
+    const int n0 = dp0.Add(sweep, {0, size.width});
+    EXPECT_GT(n0, 0);
+
+    // Rows of the shifted sweep start at a different scan col, so points that
+    // share a pixel may be fused in another order, allow a few
+    EXPECT_NEAR(dp1.Add(shifted, {0, size.width}), n0, n0 * 1e-2);
+    int num_diff = 0;
+    for (int r = 0; r < dp0.rows(); ++r) {
+      for (int c = 0; c < dp0.cols(); ++c) {
+        num_diff += static_cast<int>(dp0.PixelAt({c, r}).raw !=
+                                     dp1.PixelAt({c, r}).raw);
+      }
+    }
+    EXPECT_LT(num_diff, n0 / 100) << Repr(layout);
+  }
+}
+
+TEST(DepthPanoTest, TestRenderAsync) {
+  const auto sweep = MakeTestSweep({1024, 64});
+  DepthPano dp0{{1024, 256}};
+  dp0.Add(sweep, sweep.curr);
+  // Make pixels certain enough to be rendered
+  for (int r = 0; r < dp0.rows(); ++r) {
+    for (int c = 0; c < dp0.cols(); ++c) {
+      auto& dp = dp0.PixelAt({c, r});
+      if (dp.raw > 0) dp.cnt = dp0.max_cnt;
+    }
+  }
+  DepthPano dp1 = dp0;
+  dp1.dbuf = dp0.dbuf.clone();
+  dp1.dbuf2 = dp0.dbuf2.clone();
+
+  const Sophus::SE3d tf{Sophus::SO3d::exp({0.0, 0.0, 0.1}), {0.5, 0.2, 0.0}};
+  const int n0 = dp0.Render(tf.cast<float>());
+  EXPECT_GT(n0, 0);
+
+  PanoRenderer renderer;
+  EXPECT_FALSE(renderer.busy());
+  renderer.Start(dp1, tf);
+  EXPECT_TRUE(renderer.busy());
+  // Pano can still be added to while rendering, these points are replayed
+  renderer.Add(dp1, sweep, sweep.curr);
+  EXPECT_FALSE(renderer.pts.empty());
+  const cv::Mat prev = dp1.dbuf.clone();
+  EXPECT_EQ(renderer.Finish(dp1), n0);
+  EXPECT_FALSE(renderer.busy());
+  EXPECT_TRUE(renderer.pts.empty());
+  EXPECT_FLOAT_EQ(dp1.num_sweeps, 2);
+  EXPECT_FLOAT_EQ(renderer.num_replayed, 1);
+
+  // Same as adding the sweep in the new frame right after a sync render
+  std::vector<Eigen::Vector3f> pts;
+  dp0.GetPoints(sweep, sweep.curr, pts);
+  for (const auto& pt : pts) dp0.AddPoint(tf.cast<float>() * pt);
+  ExpectSamePixels(dp0.dbuf, dp1.dbuf);
+  // Previous pano is kept in dbuf2, like Render()
+  ExpectSamePixels(prev, dp1.dbuf2);
+}
+
+TEST(DepthPanoTest, TestRenderFast) {
+  // Fast projection may move points on pixel borders to a neighbor
+  PanoParams pp;
+  pp.proj_mode = ProjMode::kFast;
+  DepthPano dp0{{1024, 256}};
+  DepthPano dp1{{1024, 256}, pp};
+  dp0.Reset(cv::Scalar::all(1024));
+  dp1.Reset(cv::Scalar::all(1024));
+
+  const Sophus::SE3f tf{Sophus::SO3f::exp({0.0F, 0.0F, 0.1F}),
+                        {0.5F, 0.2F, 0.0F}};
+  const int n0 = dp0.Render(tf);
+  EXPECT_GT(n0, 0);
+  EXPECT_NEAR(dp1.Render(tf), n0, n0 * 1e-2);
+  int num_diff = 0;
+  for (int r = 0; r < dp0.rows(); ++r) {
+    for (int c = 0; c < dp0.cols(); ++c) {
+      num_diff += static_cast<int>(dp0.PixelAt({c, r}).raw !=
+                                   dp1.PixelAt({c, r}).raw);
+    }
+  }
+  EXPECT_LT(num_diff, n0 / 100);
+}
+
+TEST(DepthPanoTest, TestRenderParallel) {
+  // Random ranges with few distinct values, so that many source pixels land
+  // on the same destination pixel with the same range
+  DepthPano dp{{1024, 256}};
+  std::mt19937 gen{0};
+  std::uniform_int_distribution<int> dist_rg{4, 8};
+  std::uniform_int_distribution<int> dist_cnt{dp.max_cnt / 4, dp.max_cnt};
+  for (int r = 0; r < dp.rows(); ++r) {
+    for (int c = 0; c < dp.cols(); ++c) {
+      dp.PixelAt({c, r}).SetRangeCount(dist_rg(gen), dist_cnt(gen));
+    }
+  }
+
+  // Pure rotation keeps ranges, tilting squeezes rows near the top together
+  const Sophus::SE3f tf{Sophus::SO3f::exp({0.3, 0.0, 0.2}),
+                        Eigen::Vector3f::Zero()};
+  cv::Mat dst0;
+  const int n0 = dp.RenderTo(dp.dbuf, tf, dst0);
+  EXPECT_GT(n0, 0);
+
+  // Rendering rows in reverse order gives the same pano
+  cv::Mat dst1{dst0.size(), dst0.type(), cv::Scalar::all(0)};
+  for (int r = dp.rows() - 1; r >= 0; --r) dp.RenderRow(dp.dbuf, tf, r, dst1);
+  ExpectSamePixels(dst0, dst1);
+
+  for (int i = 0; i < 10; ++i) {
+    cv::Mat dst2;
+    RunConcurrently([&] { dp.RenderTo(dp.dbuf, tf, dst2, 1); });
+    ExpectSamePixels(dst0, dst2);
+  }
+}
+
+TEST(DepthPanoTest, TestFuseParallel) {
+  PanoParams params;
+  params.max_cnt = 1000;
+  DepthPano dp{{256, 32}, params};
+
+  // Every task fuses the same range into every pixel. Such updates give the
+  // same result in any order, so a lost update would show up as a lower cnt
+  const int num = 400;
+  const float rg = 4.0F;
+  RunConcurrently([&] {
+    tbb::parallel_for(tbb::blocked_range<int>(0, num, 1), [&](const auto& blk) {
+      for (int i = blk.begin(); i < blk.end(); ++i) {
+        for (int r = 0; r < dp.rows(); ++r) {
+          for (int c = 0; c < dp.cols(); ++c) dp.FuseDepth({c, r}, rg);
+        }
+      }
+    });
+  });
+
+  for (int r = 0; r < dp.rows(); ++r) {
+    for (int c = 0; c < dp.cols(); ++c) {
+      const auto& pixel = dp.PixelAt({c, r});
+      ASSERT_EQ(pixel.GetRange(), rg) << r << " " << c;
+      ASSERT_EQ(pixel.cnt, params.max_cnt / 2 + num - 1) << r << " " << c;
+    }
+  }
+}
+
+/// @brief Check that the xyz cache of dp agrees with its ranges
+void ExpectSameXyz(const DepthPano& dp) {
+  for (int r = 0; r < dp.rows(); ++r) {
+    for (int c = 0; c < dp.cols(); ++c) {
+      const auto pt = dp.model.Backward(r, c, dp.RangeAt({c, r}));
+      ASSERT_EQ(dp.PointAt({c, r}), pt) << r << " " << c;
+    }
+  }
+}
+
+TEST(DepthPanoTest, TestCacheXyz) {
+  PanoParams params;
+  params.cache_xyz = true;
+  DepthPano dp{{1024, 256}, params};
+  // Cache starts consistent with the empty pano, and follows Reset()
+  ExpectSameXyz(dp);
+  dp.Reset(cv::Scalar::all(DepthPixel::kScale));
+  ExpectSameXyz(dp);
+  dp.Reset();
+
+  // Add twice so that pixels are fused, with rows running concurrently
+  const auto sweep = MakeTestSweep({1024, 64});
+  RunConcurrently([&] {
+    dp.Add(sweep, sweep.curr, 1);
+    dp.Add(sweep, sweep.curr, 1);
+  });
+  ExpectSameXyz(dp);
+
+  // Window statistics are the same with and without cache
+  const cv::Rect win{500, 120, 5, 5};
+  const auto rg = dp.RangeAt({502, 122});
+  ASSERT_GT(rg, 0);
+  MeanCovar3f mc0;
+  MeanCovar3f mc1;
+  const auto w0 = dp.CalcMeanCovar(win, rg, mc0);
+  dp.cache_xyz = false;
+  const auto w1 = dp.CalcMeanCovar(win, rg, mc1);
+  dp.cache_xyz = true;
+  EXPECT_EQ(w0, w1);
+  EXPECT_EQ(mc0.n, mc1.n);
+  EXPECT_TRUE(mc0.mean.isApprox(mc1.mean));
+  EXPECT_TRUE(mc0.Covar().isApprox(mc1.Covar()));
+
+  // Both renders recompute the cache
+  for (int r = 0; r < dp.rows(); ++r) {
+    for (int c = 0; c < dp.cols(); ++c) {
+      auto& pixel = dp.PixelAt({c, r});
+      if (pixel.raw > 0) pixel.cnt = dp.max_cnt;
+    }
+  }
+  const Sophus::SE3d tf{Sophus::SO3d::exp({0.0, 0.0, 0.1}), {0.5, 0.2, 0.0}};
+  PanoRenderer renderer;
+  renderer.Start(dp, tf);
+  EXPECT_GT(renderer.Finish(dp), 0);
+  ExpectSameXyz(dp);
+
+  EXPECT_GT(dp.Render(tf.inverse().cast<float>()), 0);
+  ExpectSameXyz(dp);
+}
+
 void BM_PanoAddSweep(benchmark::State& state) {
   DepthPano pano({1024, 256});
   const auto sweep = MakeTestSweep({1024, 64});
@@ -29,9 +355,26 @@ void BM_PanoAddSweep(benchmark::State& state) {
 }
 BENCHMARK(BM_PanoAddSweep)->Arg(0)->Arg(1)->Arg(2)->Arg(4);
 
+void BM_PanoAddPlanar(benchmark::State& state) {
+  PanoParams pp;
+  pp.proj_mode = static_cast<ProjMode>(state.range(0));
+  DepthPano pano({1024, 256}, pp);
+  const auto sweep = MakeTestSweep({1024, 64}, ScanLayout::kPlanar);
+
+  for (auto _ : state) {
+    pano.Add(sweep, sweep.curr);
+    benchmark::DoNotOptimize(pano);
+  }
+}
+BENCHMARK(BM_PanoAddPlanar)
+    ->Arg(static_cast<int>(ProjMode::kExact))
+    ->Arg(static_cast<int>(ProjMode::kFast));
+
 void BM_PanoRender(benchmark::State& state) {
-  DepthPano pano({1024, 256});
-  pano.dbuf.setTo(1024);
+  PanoParams pp;
+  pp.proj_mode = static_cast<ProjMode>(state.range(1));
+  DepthPano pano({1024, 256}, pp);
+  pano.Reset(cv::Scalar::all(1024));
   const int gsize = state.range(0);
 
   for (auto _ : state) {
@@ -39,7 +382,56 @@ void BM_PanoRender(benchmark::State& state) {
     benchmark::DoNotOptimize(pano);
   }
 }
-BENCHMARK(BM_PanoRender)->Arg(0)->Arg(1)->Arg(2)->Arg(4);
+BENCHMARK(BM_PanoRender)
+    ->Args({0, static_cast<int>(ProjMode::kExact)})
+    ->Args({1, static_cast<int>(ProjMode::kExact)})
+    ->Args({2, static_cast<int>(ProjMode::kExact)})
+    ->Args({4, static_cast<int>(ProjMode::kExact)})
+    ->Args({0, static_cast<int>(ProjMode::kFast)});
+
+void BM_PanoRenderStart(benchmark::State& state) {
+  DepthPano pano({1024, 256});
+  pano.Reset(cv::Scalar::all(1024));
+  PanoRenderer renderer{static_cast<int>(state.range(0))};
+
+  // Only Start() is on the critical path, the render itself is not timed
+  for (auto _ : state) {
+    renderer.Start(pano, {});
+    state.PauseTiming();
+    renderer.Finish(pano);
+    pano.Reset(cv::Scalar::all(1024));
+    state.ResumeTiming();
+  }
+}
+BENCHMARK(BM_PanoRenderStart)->Arg(0)->Arg(4)->Iterations(100);
+
+void BM_PanoCalcMeanCovar(benchmark::State& state) {
+  PanoParams params;
+  params.cache_xyz = state.range(1) > 0;
+  DepthPano pano({1024, 256}, params);
+  pano.Reset(cv::Scalar::all(DepthPixel::kScale));
+  const int half = state.range(0);
+  const int width = 2 * half + 1;
+
+  MeanCovar3f mc;
+  for (auto _ : state) {
+    // One window per grid cell, like GicpSolver::MatchCell()
+    for (int r = 0; r < 32; ++r) {
+      for (int c = 0; c < 64; ++c) {
+        const cv::Point px{c * 16, r * 8};
+        const cv::Rect win{px.x - half, px.y - half, width, width};
+        benchmark::DoNotOptimize(pano.CalcMeanCovar(win, 1.0F, mc));
+      }
+    }
+  }
+}
+BENCHMARK(BM_PanoCalcMeanCovar)
+    ->Args({1, 0})
+    ->Args({1, 1})
+    ->Args({2, 0})
+    ->Args({2, 1})
+    ->Args({3, 0})
+    ->Args({3, 1});
 
 }  // namespace
 }  // namespace sv
@@ -3,13 +3,20 @@
 #include <fmt/core.h>
 #include <glog/logging.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #include <opencv2/core.hpp>
 
+#include "sv/util/ocv.h"  // Repr
+
 namespace sv {
 
 /// ScanBase ===================================================================
 ScanBase::ScanBase(const cv::Size& size, int dtype) : mat{size, dtype} {
   tfs.resize(size.width);
+  tf34s.resize(size.width, Matrix34f::Identity());
 }
 
 ScanBase::ScanBase(double time,
@@ -32,13 +39,6 @@ void ScanBase::UpdateTime(double new_time, double new_dt) {
   }
 }
 
-cv::Mat ScanBase::ExtractRange() const {
-  static cv::Mat range;
-  cv::Mat image(size(), CV_16UC(8), mat.data);
-  cv::extractChannel(image, range, 6);
-  return range;
-}
-
 void ScanBase::UpdateView(const cv::Range& new_curr) {
   const int width = new_curr.size();
   CHECK_EQ(new_curr.start, curr.end % cols());
@@ -47,8 +47,47 @@ void ScanBase::UpdateView(const cv::Range& new_curr) {
 }
 
 /// LidarScan ==================================================================
-LidarScan::LidarScan(const cv::Size& size) : ScanBase{size, kDtype} {
-  mat.setTo(kNaNF);
+std::string Repr(ScanLayout layout) {
+  switch (layout) {
+    case ScanLayout::kPacked:
+      return "packed";
+    case ScanLayout::kPlanar:
+      return "planar";
+    case ScanLayout::kCompact:
+      return "compact";
+    default:
+      return "unknown";
+  }
+}
+
+LidarScan::LidarScan(const cv::Size& size,
+                     ScanLayout layout,
+                     const cv::Mat& beams)
+    : ScanBase{size, layout == ScanLayout::kPacked ? kDtype : CV_16UC1},
+      layout{layout} {
+  if (layout == ScanLayout::kPacked) {
+    mat.setTo(kNaNF);
+    range = cv::Mat::zeros(size, CV_16UC1);
+    return;
+  }
+
+  // In planar and compact layouts mat is the range plane itself, so everything
+  // that only needs range (score, count) reads 2 bytes per pixel instead of 16
+  mat.setTo(0);
+  range = mat;
+  intensity = cv::Mat::zeros(size, CV_16UC1);
+
+  if (layout == ScanLayout::kPlanar) {
+    xyz.create(size.height * 3, size.width, CV_32FC1);
+    xyz.setTo(kNaNF);
+  } else {
+    // Compact layout keeps no xyz and reconstructs it from range along the
+    // beam direction of each pixel, so it needs beams that match the sensor.
+    // Beams are copied since a destaggered sweep shifts them in place
+    CHECK_EQ(beams.type(), CV_32FC3) << "Beams type mismatch";
+    CHECK_EQ(beams.size(), size) << "Beams size mismatch";
+    this->beams = beams.clone();
+  }
 }
 
 LidarScan::LidarScan(double time,
@@ -59,50 +98,240 @@ LidarScan::LidarScan(double time,
     : ScanBase{time, dt, scan, curr}, scale{scale} {
   CHECK_EQ(scan.type(), kDtype) << "Mat type mismatch";
   CHECK_GT(scale, 0) << "Scale must be positive";
+  range.create(size(), CV_16UC1);
+  ExtractRange({0, cols()});
+}
+
+void LidarScan::Reset(double new_time,
+                      double new_dt,
+                      double new_scale,
+                      const cv::Range& new_curr) {
+  CHECK(layout == ScanLayout::kPacked) << "Only packed scan can be reset";
+  CHECK_EQ(type(), kDtype) << "Mat type mismatch";
+  CHECK_GE(new_time, 0) << "Time cannot be negative";
+  CHECK_GT(new_dt, 0) << "Delta time must be positive";
+  CHECK_GT(new_scale, 0) << "Scale must be positive";
+  CHECK_EQ(cols(), new_curr.size()) << "Mat width mismatch";
+
+  time = new_time;
+  dt = new_dt;
+  scale = new_scale;
+  curr = new_curr;
+  range.create(size(), CV_16UC1);  // noop if already allocated
+  ExtractRange({0, cols()});
+}
+
+void LidarScan::ExtractRange(const cv::Range& cols) {
+  CHECK(layout == ScanLayout::kPacked) << "Only packed scan has pixels in mat";
+  // Each scan owns its range plane and only the given cols are touched, so
+  // different scans/sweeps can do this concurrently
+  for (int r = 0; r < rows(); ++r) {
+    const auto* pixels = mat.ptr<PixelT>(r);
+    auto* ranges = range.ptr<uint16_t>(r);
+    for (int c = cols.start; c < cols.end; ++c) {
+      ranges[c] = pixels[c].range_raw;
+    }
+  }
 }
 
 void LidarScan::CalcMeanCovar(const cv::Rect& rect, MeanCovar3f& mc) const {
-  mc.Reset();
+  MomentSum3f ms;
 
-  // NOTE (chao): for now only take first row of cell due to staggered scan
-  for (int c = 0; c < rect.width; ++c) {
-    const auto& xyzr = PixelAt({rect.x + c, rect.y});
-    if (xyzr.Ok()) mc.Add(xyzr.Vec3fMap());
+  // NOTE (chao): only take first row of cell if scan is staggered
+  const int height = destaggered ? rect.height : 1;
+  for (int r = 0; r < height; ++r) {
+    const int y = rect.y + r;
+    if (layout == ScanLayout::kPacked) {
+      // x, y, z of a pixel are contiguous and pixels are 4 floats apart
+      const auto* p = mat.ptr<float>(y) + rect.x * 4;
+      ms.Add(p, p + 1, p + 2, 4, rect.width);
+    } else if (layout == ScanLayout::kPlanar) {
+      ms.Add(XyzRow(0, y) + rect.x,
+             XyzRow(1, y) + rect.x,
+             XyzRow(2, y) + rect.x,
+             1,
+             rect.width);
+    } else {
+      for (int c = 0; c < rect.width; ++c) {
+        const auto& xyzr = PixelAt({rect.x + c, y});
+        if (xyzr.Ok()) ms.Add(xyzr.Vec3fMap());
+      }
+    }
   }
+  ms.Finalize(mc);
 }
 
-cv::Vec2f LidarScan::CalcScore(const cv::Point& px, int width) const {
+cv::Vec2f LidarScan::CalcScore(const cv::Rect& rect) const {
   cv::Vec2f score(kNaNF, kNaNF);
+  for (int r = 0; r < rect.height; ++r) {
+    const auto s = CalcScore({rect.x, rect.y + r}, rect.width);
+    if (std::isnan(s[0])) continue;
+    // nan compares false so the first valid row is always taken
+    if (!(s[0] <= score[0])) score[0] = s[0];
+    if (!(s[1] <= score[1])) score[1] = s[1];
+  }
+  return score;
+}
+
+cv::Vec2f LidarScan::CalcScore(const cv::Point& px, int width) const {
+  cv::Vec2f score;
+  CalcScoreRow(px, width, 1, &score);
+  return score;
+}
 
-  // compute sum of range in cell
-  int n = 0;
-  float sum = 0.0F;
-  float sq_sum = 0.0F;
+void LidarScan::CalcScoreRow(const cv::Point& px,
+                             int width,
+                             int num,
+                             cv::Vec2f* scores) const {
+  CHECK_LE(px.x + width * num, cols());
+  // Only read the range plane, which is the same for all layouts
+  ScoreCells(range.ptr<uint16_t>(px.y) + px.x, width, num, scale, scores);
+}
 
-  const int half = width / 2;
-  const auto left = RangeAt({px.x + half - 1, px.y});
-  const auto right = RangeAt({px.x + half, px.y});
-  const auto mid = std::min(left, right);
-  if (mid == 0) return score;
+/// Range kernels ==============================================================
+namespace {
 
+/// @brief Exact sums of a cell, zero range is invalid and adds nothing
+struct CellSums {
+  int n{};           // number of valid ranges
+  int64_t sum{};     // sum of raw ranges
+  int64_t sq_sum{};  // sum of squared raw ranges
+};
+
+CellSums SumCellScalar(const uint16_t* ranges, int width) {
+  CellSums s;
   for (int c = 0; c < width; ++c) {
-    const auto& pixel = PixelAt({px.x + c, px.y});
-    if (!pixel.Ok()) continue;
-    const float rg = pixel.range_raw / scale;
+    const int64_t rg = ranges[c];
+    s.n += static_cast<int>(rg > 0);
+    s.sum += rg;
+    s.sq_sum += rg * rg;
+  }
+  return s;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) CellSums SumCellAvx2(const uint16_t* ranges,
+                                                     int width) {
+  const __m128i zero = _mm_setzero_si128();
+  __m256i sum = _mm256_setzero_si256();     // 8 x int32
+  __m256i sq_sum = _mm256_setzero_si256();  // 4 x int64
+  int num_zeros = 0;
 
-    sum += rg;
-    sq_sum += rg * rg;
-    ++n;
+  int c = 0;
+  for (; c + 8 <= width; c += 8) {
+    const auto x16 =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(ranges + c));
+    // Each zero range sets 2 bits of the byte mask
+    num_zeros += __builtin_popcount(
+                     _mm_movemask_epi8(_mm_cmpeq_epi16(x16, zero))) /
+                 2;
+
+    // Raw range squared fits in uint32 but not their sum, so square even and
+    // odd lanes separately into int64
+    const auto x = _mm256_cvtepu16_epi32(x16);
+    const auto x_odd = _mm256_srli_epi64(x, 32);
+    sum = _mm256_add_epi32(sum, x);
+    sq_sum = _mm256_add_epi64(sq_sum, _mm256_mul_epu32(x, x));
+    sq_sum = _mm256_add_epi64(sq_sum, _mm256_mul_epu32(x_odd, x_odd));
   }
 
-  // Discard if there are fewer than 8 points
-  if (n < 8) return score;
+  alignas(32) int32_t sums[8];
+  alignas(32) int64_t sq_sums[4];
+  _mm256_store_si256(reinterpret_cast<__m256i*>(sums), sum);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(sq_sums), sq_sum);
+
+  // Remaining ranges if width is not a multiple of 8
+  auto s = SumCellScalar(ranges + c, width - c);
+  s.n += c - num_zeros;
+  for (const auto v : sums) s.sum += v;
+  for (const auto v : sq_sums) s.sq_sum += v;
+  return s;
+}
+#endif
 
-  // Check variance
+/// @brief Smoothness and variance score from sums, shared by all simd levels
+cv::Vec2f CalcCellScore(const CellSums& s, int mid_raw, double scale) {
+  // Discard if mid is invalid or there are fewer than 8 points
+  if (mid_raw == 0 || s.n < 8) return {kNaNF, kNaNF};
+
+  // Scale cancels out in curve, and variance is n * sq_sum - sum^2, which is
+  // exact in int64
   // https://www.johndcook.com/blog/standard_deviation/
-  score[0] = std::abs(sum / mid / n - 1.0F);
-  score[1] = 1.0 / (n * (n - 1)) * (n * sq_sum - sum * sum) / mid;
-  return score;
+  const int64_t n = s.n;
+  const double curve = static_cast<double>(s.sum) / (n * mid_raw) - 1.0;
+  const double var = static_cast<double>(n * s.sq_sum - s.sum * s.sum) /
+                     (n * (n - 1)) / (mid_raw * scale);
+  return {static_cast<float>(std::abs(curve)), static_cast<float>(var)};
+}
+
+}  // namespace
+
+void ScoreCells(const uint16_t* ranges,
+                int width,
+                int num,
+                double scale,
+                cv::Vec2f* scores,
+                SimdLevel level) {
+  const int half = width / 2;
+
+  for (int i = 0; i < num; ++i) {
+    const auto* cell = ranges + i * width;
+    const int mid_raw = std::min(cell[half - 1], cell[half]);
+
+    CellSums sums;
+#if defined(__x86_64__) || defined(__i386__)
+    if (level == SimdLevel::kAvx2) {
+      sums = SumCellAvx2(cell, width);
+    } else {
+      sums = SumCellScalar(cell, width);
+    }
+#else
+    sums = SumCellScalar(cell, width);
+#endif
+    scores[i] = CalcCellScore(sums, mid_raw, scale);
+  }
+}
+
+/// ScanPool ===================================================================
+ScanPool::ScanPool(const cv::Size& size, int capacity)
+    : size{size}, capacity{capacity} {
+  CHECK_GE(capacity, 0);
+  scans.reserve(capacity);
+  for (int i = 0; i < capacity; ++i) {
+    LidarScan scan;
+    scan.mat.create(size, LidarScan::kDtype);
+    scan.range.create(size, CV_16UC1);
+    scans.push_back(std::move(scan));
+  }
+}
+
+std::string ScanPool::Repr() const {
+  return fmt::format("ScanPool(size={}, capacity={}, free={}, misses={})",
+                     sv::Repr(size),
+                     capacity,
+                     scans.size(),
+                     num_misses);
+}
+
+bool ScanPool::Acquire(const cv::Size& scan_size, LidarScan& scan) {
+  if (scan_size == size && !scans.empty()) {
+    scan = std::move(scans.back());
+    scans.pop_back();
+    return true;
+  }
+
+  // Pool is empty or scan has a different size (e.g. a partial packet)
+  ++num_misses;
+  scan = LidarScan{};
+  scan.mat.create(scan_size, LidarScan::kDtype);
+  scan.range.create(scan_size, CV_16UC1);
+  return false;
+}
+
+void ScanPool::Release(LidarScan&& scan) {
+  if (static_cast<int>(scans.size()) >= capacity) return;
+  if (scan.size() != size || scan.type() != LidarScan::kDtype) return;
+  scans.push_back(std::move(scan));
 }
 
 /// Test Related ===============================================================
@@ -133,4 +362,26 @@ LidarScan MakeTestScan(const cv::Size& size) {
   return {0, 0.1 / size.width, 512.0, MakeTestMat(size), {0, size.width}};
 }
 
+cv::Mat MakeTestBeams(const cv::Size& size) {
+  return MakeBeams(LidarModel{size, kPiF / 2});
+}
+
+LidarScan MakeTestCompactScan(const cv::Size& size) {
+  const auto beams = MakeTestBeams(size);
+  cv::Mat xyzr = cv::Mat::zeros(size, LidarScan::kDtype);
+
+  for (int i = 0; i < xyzr.rows; ++i) {
+    for (int j = 0; j < xyzr.cols; ++j) {
+      const auto& beam = beams.at<cv::Point3f>(i, j);
+      auto& p = xyzr.at<ScanPixel>(i, j);
+      p.x = beam.x;
+      p.y = beam.y;
+      p.z = beam.z;
+      p.range_raw = 512;  // unit range with scale 512
+    }
+  }
+
+  return {0, 0.1 / size.width, 512.0, xyzr, {0, size.width}};
+}
+
 }  // namespace sv
@@ -3,10 +3,14 @@
 #include <opencv2/core/mat.hpp>
 #include <sophus/se3.hpp>
 
+#include "sv/llol/lidar.h"
 #include "sv/util/math.h"  // MeanCovar
 
 namespace sv {
 
+/// @brief Row-major [R|t], cheaper to apply to points than a quaternion
+using Matrix34f = Eigen::Matrix<float, 3, 4, Eigen::RowMajor>;
+
 struct ScanBase {
   // start and delta time
   double time{};  // time of the last column
@@ -16,6 +20,7 @@ struct ScanBase {
   cv::Mat mat;                    // storage
   cv::Range curr;                 // current range
   std::vector<Sophus::SE3f> tfs;  // tfs of each col to some frame
+  std::vector<Matrix34f> tf34s;   // tfs as 3x4 matrices, see SetTfAt()
 
   ScanBase() = default;
   ScanBase(const cv::Size& size, int dtype);
@@ -33,13 +38,22 @@ struct ScanBase {
 
   double TimeAt(int col) const { return time - dt * (cols() - col); }
   const Sophus::SE3f& TfAt(int c) const { return tfs.at(c); }
+  const Matrix34f& Tf34At(int c) const { return tf34s[c]; }
+  /// @brief Set tf of col c, also updates its 3x4 matrix
+  void SetTfAt(int c, const Sophus::SE3f& tf) {
+    tfs.at(c) = tf;
+    tf34s[c] = tf.matrix3x4();
+  }
+  /// @brief Transform point by tf of col c
+  Eigen::Vector3f TransformAt(int c, const Eigen::Vector3f& pt) const {
+    const auto& tf = tf34s[c];
+    return tf.leftCols<3>() * pt + tf.col(3);
+  }
 
   /// @brief Update view (curr and span) given new curr
   void UpdateView(const cv::Range& new_curr);
   /// @brief Update time (time and dt) given new time
   void UpdateTime(double new_time, double new_dt);
-  /// @brief Extract the range channel (16UC1)
-  cv::Mat ExtractRange() const;
 };
 
 /// @struct This should match the ouster scan
@@ -52,40 +66,146 @@ struct ScanPixel {
 
   bool Ok() const noexcept { return !std::isnan(x); }
   auto Vec3fMap() const { return Eigen::Map<const Eigen::Vector3f>(&x); }
+  auto Vec3fMap() { return Eigen::Map<Eigen::Vector3f>(&x); }
 };
 static_assert(sizeof(ScanPixel) == sizeof(float) * 4,
               "Size of ScanPixel must be 16");
 
+/// @enum Storage layout of a lidar scan
+enum class ScanLayout {
+  kPacked,  // interleaved ScanPixel in mat (32FC4)
+  kPlanar,  // separate x,y,z,range,intensity planes, mat is the range plane
+  kCompact,  // range and intensity planes only, xyz from model, mat is range
+};
+
+std::string Repr(ScanLayout layout);
+
+/// @brief Score num consecutive cells of width in a row of raw ranges, see
+/// LidarScan::CalcScore(). Range sums are accumulated as exact integers, so
+/// all simd levels give bit-identical scores
+void ScoreCells(const uint16_t* ranges,
+                int width,
+                int num,
+                double scale,
+                cv::Vec2f* scores,
+                SimdLevel level = GetSimdLevel());
+
 /// @struct Lidar Scan like an image, with pixel (x,y,z,r)
 struct LidarScan : public ScanBase {
   using PixelT = ScanPixel;
   static constexpr int kDtype = CV_32FC4;
 
   /// data
-  double scale{};  // scale for converting range to float
+  ScanLayout layout{ScanLayout::kPacked};
+  double scale{};     // scale for converting range to float
+  cv::Mat range;      // range channel of mat (16UC1), see ExtractRange()
+  cv::Mat xyz;        // x,y,z planes stacked vertically (32FC1), planar only
+  cv::Mat intensity;  // intensity plane (16UC1), planar and compact only
+  cv::Mat beams;      // unit beam direction of each pixel (32FC3), compact only
+
+  /// Whether rows are aligned in time (see LidarSweep::shifts), so that a cell
+  /// can use all its rows instead of only the first one
+  bool destaggered{false};
 
   LidarScan() = default;
   /// @brief Ctor for allocating storage
-  explicit LidarScan(const cv::Size& size);
+  /// @param beams Unit beam direction of each pixel, compact only, see
+  /// MakeBeams()
+  explicit LidarScan(const cv::Size& size,
+                     ScanLayout layout = ScanLayout::kPacked,
+                     const cv::Mat& beams = {});
   /// @brief Ctor for incoming lidar scan
+  /// @note This allocates a range plane, per packet scans should be taken from
+  /// ScanPool and Reset() instead
   LidarScan(double time,
             double dt,
             double scale,
             const cv::Mat& scan,
             const cv::Range& curr);
 
+  /// @brief Reset an incoming scan whose mat is already filled in place (e.g.
+  /// one from ScanPool), range is reused if it has the right size
+  void Reset(double time, double dt, double scale, const cv::Range& curr);
+
   /// @brief At
-  const auto& PixelAt(const cv::Point& px) const { return mat.at<PixelT>(px); }
+  PixelT PixelAt(const cv::Point& px) const {
+    if (layout == ScanLayout::kPacked) return mat.at<PixelT>(px);
+    PixelT pixel;
+    pixel.range_raw = range.at<uint16_t>(px);
+    pixel.intensity = intensity.at<uint16_t>(px);
+    if (layout == ScanLayout::kPlanar) {
+      pixel.x = XyzRow(0, px.y)[px.x];
+      pixel.y = XyzRow(1, px.y)[px.x];
+      pixel.z = XyzRow(2, px.y)[px.x];
+    } else if (pixel.range_raw == 0) {
+      pixel.x = pixel.y = pixel.z = kNaNF;
+    } else {
+      pixel.Vec3fMap() = BeamAt(px) * RangeAt(px);
+    }
+    return pixel;
+  }
+  /// @brief Unit beam direction of pixel px, compact only
+  Eigen::Vector3f BeamAt(const cv::Point& px) const {
+    const auto& beam = beams.at<cv::Point3f>(px);
+    return {beam.x, beam.y, beam.z};
+  }
   float RangeAt(const cv::Point& px) const {
-    return PixelAt(px).range_raw / scale;
+    return range.at<uint16_t>(px) / scale;
   }
 
+  /// @brief Row r of plane k (0,1,2 for x,y,z), planar only
+  const float* XyzRow(int k, int r) const {
+    return xyz.ptr<float>(k * rows() + r);
+  }
+  float* XyzRow(int k, int r) { return xyz.ptr<float>(k * rows() + r); }
+
+  /// @brief Extract range channel of mat within cols into range, packed only
+  void ExtractRange(const cv::Range& cols);
+
   /// @brief Calculate smoothness and variance score of a cell starting at px
   cv::Vec2f CalcScore(const cv::Point& px, int width) const;
-  /// @brief Calculate mean and covar of a cell in rect
+  /// @brief Score num cells of width starting at px within the same row
+  void CalcScoreRow(const cv::Point& px,
+                    int width,
+                    int num,
+                    cv::Vec2f* scores) const;
+  /// @brief Worst score of all rows in rect, nan rows are ignored
+  cv::Vec2f CalcScore(const cv::Rect& rect) const;
+  /// @brief Calculate mean and covar of a cell in rect, only the first row is
+  /// used unless the scan is destaggered
   void CalcMeanCovar(const cv::Rect& rect, MeanCovar3f& mc) const;
 };
 
+/// @struct Fixed capacity pool of incoming packed scans, so that scans of the
+/// same size reuse their storage instead of allocating per packet
+/// @note Not thread-safe, and a released scan must not be shared elsewhere
+struct ScanPool {
+  cv::Size size{};               // size of pooled scans
+  int capacity{};                // max number of free scans kept
+  int num_misses{};              // number of Acquire() that allocated
+  std::vector<LidarScan> scans;  // free scans
+
+  ScanPool() = default;
+  /// @brief Pre-allocate capacity scans of size
+  ScanPool(const cv::Size& size, int capacity);
+
+  std::string Repr() const;
+  friend std::ostream& operator<<(std::ostream& os, const ScanPool& rhs) {
+    return os << rhs.Repr();
+  }
+
+  /// @brief Take a scan of scan_size from pool, allocate if there is none
+  /// @return True if scan is from pool, false if it is a miss
+  bool Acquire(const cv::Size& scan_size, LidarScan& scan);
+  /// @brief Give scan back to pool, dropped if pool is full or size mismatch
+  void Release(LidarScan&& scan);
+};
+
 LidarScan MakeTestScan(const cv::Size& size);
+/// @brief Beams of a uniform model with the same fov as MakeTestScan()
+cv::Mat MakeTestBeams(const cv::Size& size);
+/// @brief Test scan whose xyz is exactly range along MakeTestBeams(), so that
+/// it can be compared with a compact scan
+LidarScan MakeTestCompactScan(const cv::Size& size);
 
 }  // namespace sv
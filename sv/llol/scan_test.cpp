@@ -34,5 +34,63 @@ TEST(ScanTest, TestUpdate) {
   EXPECT_EQ(s.curr.end, 20);
 }
 
+TEST(ScanTest, TestExtractRange) {
+  auto scan = MakeTestScan({8, 4});
+  EXPECT_EQ(scan.range.type(), CV_16UC1);
+  EXPECT_EQ(scan.range.at<uint16_t>(0, 0), 1024);
+  EXPECT_EQ(scan.range.at<uint16_t>(3, 7), 1024);
+
+  // Only cols within range are updated
+  scan.mat.setTo(0);
+  scan.ExtractRange({2, 4});
+  EXPECT_EQ(scan.range.at<uint16_t>(0, 1), 1024);
+  EXPECT_EQ(scan.range.at<uint16_t>(0, 2), 0);
+  EXPECT_EQ(scan.range.at<uint16_t>(3, 3), 0);
+  EXPECT_EQ(scan.range.at<uint16_t>(3, 4), 1024);
+}
+
+TEST(ScanTest, TestPool) {
+  const cv::Size size{8, 4};
+  ScanPool pool(size, 2);
+  EXPECT_EQ(pool.scans.size(), 2);
+  std::cout << pool << "\n";
+
+  // Pooled scans reuse storage
+  LidarScan scan;
+  EXPECT_TRUE(pool.Acquire(size, scan));
+  const auto* data = scan.mat.data;
+  MakeTestScan(size).mat.copyTo(scan.mat);
+  scan.Reset(1.0, 0.1, 512.0, {0, 8});
+  EXPECT_EQ(scan.mat.data, data);
+  EXPECT_EQ(scan.range.at<uint16_t>(3, 7), 1024);
+  pool.Release(std::move(scan));
+  EXPECT_EQ(pool.scans.size(), 2);
+
+  LidarScan scan1;
+  EXPECT_TRUE(pool.Acquire(size, scan1));
+  EXPECT_EQ(scan1.mat.data, data);
+
+  // Pool is empty after this
+  LidarScan scan2;
+  EXPECT_TRUE(pool.Acquire(size, scan2));
+  LidarScan scan3;
+  EXPECT_FALSE(pool.Acquire(size, scan3));
+  EXPECT_EQ(pool.num_misses, 1);
+
+  // Size mismatch is a miss and is not taken back
+  LidarScan scan4;
+  EXPECT_FALSE(pool.Acquire({4, 4}, scan4));
+  EXPECT_EQ(scan4.cols(), 4);
+  EXPECT_EQ(pool.num_misses, 2);
+  pool.Release(std::move(scan4));
+  EXPECT_TRUE(pool.scans.empty());
+
+  // Full pool drops extra scans
+  pool.Release(std::move(scan1));
+  pool.Release(std::move(scan2));
+  pool.Release(std::move(scan3));
+  EXPECT_EQ(pool.scans.size(), 2);
+}
+
 }  // namespace
 }  // namespace sv
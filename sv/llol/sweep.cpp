@@ -1,16 +1,54 @@
 #include "sv/llol/sweep.h"
 
 #include <glog/logging.h>
-#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_reduce.h>
 
+#include <algorithm>  // min_element
+#include <numeric>    // accumulate
 #include <opencv2/core.hpp>
 
 #include "sv/util/ocv.h"
 
 namespace sv {
 
+void LidarSweep::SetShifts(const std::vector<int>& pixel_shifts) {
+  const auto prev_shifts = shifts;
+  shifts = pixel_shifts;
+  max_shift = 0;
+
+  if (!shifts.empty()) {
+    CHECK_EQ(static_cast<int>(shifts.size()), rows())
+        << "Need one pixel shift per row";
+    // Shift is modulo cols, so we make all of them non-negative, which only
+    // rotates the sweep as a whole
+    const int min_shift = *std::min_element(shifts.begin(), shifts.end());
+    for (auto& s : shifts) {
+      s -= min_shift;
+      CHECK_LT(s, cols()) << "Pixel shift must be less than sweep width";
+      max_shift = std::max(max_shift, s);
+    }
+  }
+
+  // Beam of scan col c is stored at sweep col c + shift, like its pixel
+  if (beams.empty()) return;
+  for (int r = 0; r < rows(); ++r) {
+    const int prev = prev_shifts.empty() ? 0 : prev_shifts[r];
+    const int delta = ShiftAt(r) - prev;
+    if (delta == 0) continue;
+
+    const cv::Mat row = beams.row(r).clone();
+    const auto* src = row.ptr<cv::Point3f>();
+    auto* dst = beams.ptr<cv::Point3f>(r);
+    for (int c = 0; c < cols(); ++c) {
+      dst[WrapCols((c + delta) % cols(), cols())] = src[c];
+    }
+  }
+}
+
 int LidarSweep::Add(const LidarScan& scan) {
-  CHECK_EQ(scan.type(), type());
+  CHECK(scan.layout == ScanLayout::kPacked) << "Incoming scan must be packed";
+  CHECK_EQ(scan.type(), kDtype);
   CHECK_EQ(scan.rows(), rows());
   CHECK_LE(scan.cols(), cols());
 
@@ -18,56 +56,239 @@ int LidarSweep::Add(const LidarScan& scan) {
   UpdateView(scan.curr);
   scale = scan.scale;
 
-  // copy to storage
-  scan.mat.copyTo(mat.colRange(curr));  // x,y,w,h
-  return cv::countNonZero(ExtractRange());
+  const int num_before = num_points;
+  for (int r = 0; r < rows(); ++r) {
+    // Each row is shifted and wrapped around, so it is at most 2 segments
+    const int sc = (curr.start + ShiftAt(r)) % cols();
+    const int c_wrap = std::min(scan.cols(), cols() - sc);
+    CopyRow(scan, r, 0, c_wrap, sc);
+    CopyRow(scan, r, c_wrap, scan.cols(), 0);
+  }
+
+  // With destagger, cols up to max_shift after curr are also touched
+  const int end = curr.end + max_shift;
+  CountPoints({curr.start, std::min(end, cols())});
+  if (end > cols()) CountPoints({0, end - cols()});
+  return num_points - num_before;
+}
+
+cv::Mat LidarSweep::Reserve(const cv::Range& cols) {
+  CHECK(CanReserve()) << "Only packed sweep without destagger can be reserved";
+  // Same check as UpdateView() in Commit(), but before anything is written
+  CHECK_EQ(cols.start, curr.end % this->cols())
+      << "Reserved cols must follow curr";
+  CHECK_LE(0, cols.start);
+  CHECK_LE(cols.end, this->cols());
+  return mat.colRange(cols);
+}
+
+int LidarSweep::Commit(double time,
+                       double dt,
+                       double scale,
+                       const cv::Range& cols) {
+  CHECK(CanReserve()) << "Only packed sweep without destagger can be reserved";
+  CHECK_GT(scale, 0) << "Scale must be positive";
+
+  UpdateTime(time, dt);
+  UpdateView(cols);
+  this->scale = scale;
+
+  // Pixels are already in place, only derived data needs update
+  const int num_before = num_points;
+  ExtractRange(curr);
+  CountPoints(curr);
+  return num_points - num_before;
+}
+
+int LidarSweep::CopyRow(const LidarScan& scan, int r, int c0, int c1, int sc) {
+  if (c0 >= c1) return 0;
+
+  int n = 0;
+  const auto* pixels = scan.mat.ptr<PixelT>(r) + c0;
+  const int width = c1 - c0;
+  auto* ranges = range.ptr<uint16_t>(r) + sc;
+  for (int c = 0; c < width; ++c) {
+    ranges[c] = pixels[c].range_raw;
+    n += static_cast<int>(ranges[c] > 0);
+  }
+
+  if (layout == ScanLayout::kPacked) {
+    std::copy(pixels, pixels + width, mat.ptr<PixelT>(r) + sc);
+    return n;
+  }
+
+  auto* intens = intensity.ptr<uint16_t>(r) + sc;
+  for (int c = 0; c < width; ++c) {
+    intens[c] = pixels[c].intensity;
+  }
+
+  // Compact layout drops xyz
+  if (layout != ScanLayout::kPlanar) return n;
+
+  auto* xs = XyzRow(0, r) + sc;
+  auto* ys = XyzRow(1, r) + sc;
+  auto* zs = XyzRow(2, r) + sc;
+  for (int c = 0; c < width; ++c) {
+    xs[c] = pixels[c].x;
+    ys[c] = pixels[c].y;
+    zs[c] = pixels[c].z;
+  }
+  return n;
 }
 
-void LidarSweep::Interp(const Trajectory& traj, int gsize) {
+int LidarSweep::CountPoints(const cv::Range& cols) {
+  // Only cols that were overwritten need to be recounted, so this is O(scan)
+  // instead of O(sweep)
+  const auto first = col_points.begin() + cols.start;
+  const auto last = col_points.begin() + cols.end;
+  num_points -= std::accumulate(first, last, 0);
+  std::fill(first, last, 0);
+
+  // Go row by row for contiguous memory access
+  for (int r = 0; r < rows(); ++r) {
+    const auto* ranges = range.ptr<uint16_t>(r);
+    for (int c = cols.start; c < cols.end; ++c) {
+      col_points[c] += static_cast<int>(ranges[c] > 0);
+    }
+  }
+
+  const int n = std::accumulate(first, last, 0);
+  num_points += n;
+  return n;
+}
+
+LidarScan LidarSweep::CurrView() const {
+  LidarScan view;
+  view.time = time;
+  view.dt = dt;
+  view.curr = curr;
+  view.layout = layout;
+  view.scale = scale;
+  view.mat = mat.colRange(curr);
+  view.range = range.colRange(curr);
+  if (!intensity.empty()) view.intensity = intensity.colRange(curr);
+  if (!xyz.empty()) view.xyz = xyz.colRange(curr);
+  view.destaggered = destagger();
+
+  if (!beams.empty()) view.beams = beams.colRange(curr);
+  return view;
+}
+
+int LidarSweep::Interp(const Trajectory& traj, int gsize) {
   const int num_cells = traj.size() - 1;
   const int cell_width = cols() / num_cells;
   const auto grid_end = curr.end / cell_width;
   gsize = gsize <= 0 ? num_cells : gsize;
 
-  tbb::parallel_for(
-      tbb::blocked_range<int>(0, num_cells, gsize), [&](const auto& blk) {
+  knots.Update(traj, grid_end);
+
+  return tbb::parallel_reduce(
+      tbb::blocked_range<int>(0, num_cells, gsize),
+      0,
+      [&](const auto& blk, int n) {
         for (int gc = blk.begin(); gc < blk.end(); ++gc) {
           // Note that the starting point of traj is where curr
           // ends, so we need to offset by curr.end to find the
           // corresponding traj segment
-
           const int tc = WrapCols(gc - grid_end, num_cells);
           const auto& st0 = traj.At(tc);
           const auto& st1 = traj.At(tc + 1);
 
-          const auto dr = (st0.rot.inverse() * st1.rot).log();
-          const auto dp = (st1.pos - st0.pos).eval();
-
-          for (int j = 0; j < cell_width; ++j) {
-            // which column
-            const int col = gc * cell_width + j;
-            const float s = static_cast<float>(j) / cell_width;
-            Sophus::SE3d tf_p_i;
-            tf_p_i.so3() = st0.rot * Sophus::SO3d::exp(s * dr);
-            tf_p_i.translation() = st0.pos + s * dp;
-            tfs.at(col) = (tf_p_i * traj.T_imu_lidar).cast<float>();
+          switch (knots.Update(gc, st0, st1)) {
+            case KnotCache::Action::kKeep:
+              break;
+            case KnotCache::Action::kCorrect:
+              CorrectCell(gc, cell_width, st0, st1, knots.corr);
+              break;
+            case KnotCache::Action::kInterp:
+              InterpCell(gc, cell_width, st0, st1, traj.T_imu_lidar);
+              ++n;
+              break;
           }
         }
-      });
+        return n;
+      },
+      std::plus<>{});
+}
+
+void LidarSweep::InterpCell(int gc,
+                            int cell_width,
+                            const NavState& st0,
+                            const NavState& st1,
+                            const Sophus::SE3d& T_imu_lidar) {
+  const auto dr = (st0.rot.inverse() * st1.rot).log();
+  const auto dp = (st1.pos - st0.pos).eval();
+
+  if (interp_exp) {
+    for (int j = 0; j < cell_width; ++j) {
+      // which column
+      const int col = gc * cell_width + j;
+      const float s = static_cast<float>(j) / cell_width;
+      Sophus::SE3d tf_p_i;
+      tf_p_i.so3() = st0.rot * Sophus::SO3d::exp(s * dr);
+      tf_p_i.translation() = st0.pos + s * dp;
+      SetTfAt(col, (tf_p_i * T_imu_lidar).cast<float>());
+    }
+    return;
+  }
+
+  // Rotation within a cell has a constant angular step, so instead of one exp
+  // per col we accumulate a single step rotation and renormalize periodically
+  constexpr int kRenormCols = 8;
+  const auto step = Sophus::SO3d::exp(dr / cell_width).unit_quaternion();
+  Eigen::Quaterniond q = st0.rot.unit_quaternion();
+
+  for (int j = 0; j < cell_width; ++j) {
+    const int col = gc * cell_width + j;
+    const double s = static_cast<double>(j) / cell_width;
+    if (j > 0) q *= step;
+    if (j % kRenormCols == kRenormCols - 1) q.normalize();
+
+    Sophus::SE3d tf_p_i;
+    tf_p_i.so3().setQuaternion(q);
+    tf_p_i.translation() = st0.pos + s * dp;
+    SetTfAt(col, (tf_p_i * T_imu_lidar).cast<float>());
+  }
+}
+
+void LidarSweep::CorrectCell(int gc,
+                             int cell_width,
+                             const NavState& st0,
+                             const NavState& st1,
+                             const KnotCorrection& corr) {
+  // Column poses are linear in time between knots, so the correction is exact,
+  // but it is applied in float so error accumulates slowly, KnotCache bounds
+  // it by interpolating the cell again after kMaxCorrections
+  const Sophus::SO3f rot = corr.rot.cast<float>();
+  const auto dt = st1.time - st0.time;
+
+  for (int j = 0; j < cell_width; ++j) {
+    const int col = gc * cell_width + j;
+    const double s = static_cast<double>(j) / cell_width;
+    const Eigen::Vector3f trans = corr.TransAt(st0.time + s * dt).cast<float>();
+    SetTfAt(col, Sophus::SE3f{rot, trans} * tfs[col]);
+  }
 }
 
 std::string LidarSweep::Repr() const {
-  return fmt::format("LidarSweep(t0={}, dt={}, xyzr={}, col_range={})",
-                     time,
-                     dt,
-                     sv::Repr(mat),
-                     sv::Repr(curr));
+  return fmt::format(
+      "LidarSweep(t0={}, dt={}, layout={}, xyzr={}, col_range={})",
+      time,
+      dt,
+      sv::Repr(layout),
+      sv::Repr(mat),
+      sv::Repr(curr));
 }
 
-LidarSweep MakeTestSweep(const cv::Size& size) {
-  LidarSweep sweep(size);
-  LidarScan scan = MakeTestScan(size);
-  sweep.Add(scan);
+LidarSweep MakeTestSweep(const cv::Size& size, ScanLayout layout) {
+  if (layout == ScanLayout::kCompact) {
+    LidarSweep sweep(size, layout, MakeTestBeams(size));
+    sweep.Add(MakeTestCompactScan(size));
+    return sweep;
+  }
+
+  LidarSweep sweep(size, layout);
+  sweep.Add(MakeTestScan(size));
   return sweep;
 }
 
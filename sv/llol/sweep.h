@@ -7,22 +7,87 @@ namespace sv {
 
 /// @struct Lidar Sweep is a Lidar Scan that covers 360 degree hfov
 struct LidarSweep final : public LidarScan {
+  /// Params
+  bool interp_exp{false};  // one exp per col in Interp(), otherwise step rot
+
+  /// Data
+  int num_points{};             // number of valid points in sweep
+  std::vector<int> col_points;  // number of valid points in each col
+
+  /// Destagger, col c of row r in scan is stored at col c + shifts[r] in sweep
+  /// so that all rows of a col are aligned, empty means staggered
+  std::vector<int> shifts;
+  int max_shift{};
+
+  /// Knots of each cell used in the last Interp(), clear to force a full one
+  KnotCache knots;
+
   LidarSweep() = default;
-  explicit LidarSweep(const cv::Size& size) : LidarScan{size} {}
+  explicit LidarSweep(const cv::Size& size,
+                      ScanLayout layout = ScanLayout::kPacked,
+                      const cv::Mat& beams = {})
+      : LidarScan{size, layout, beams}, col_points(size.width, 0) {}
 
   std::string Repr() const;
   friend std::ostream& operator<<(std::ostream& os, const LidarSweep& rhs) {
     return os << rhs.Repr();
   }
 
+  /// @brief Set per row pixel shifts for destaggering, empty to disable
+  /// @note Shifts are normalized to be non-negative. Beams of a compact sweep
+  /// are given in scan cols and are moved along with the shifts
+  void SetShifts(const std::vector<int>& pixel_shifts);
+  int ShiftAt(int r) const { return shifts.empty() ? 0 : shifts[r]; }
+  /// @brief Col of tfs for pixel at col sc of row r in sweep, which holds scan
+  /// col sc - shift of that row when destaggered
+  int PoseCol(int sc, int r) const {
+    return shifts.empty() ? sc : WrapCols(sc - shifts[r], cols());
+  }
+  bool destagger() const noexcept { return !shifts.empty(); }
+
   /// @brief Add a scan to this sweep
-  /// @return Number of points added
+  /// @return Change of num_points, which is negative if the scan has fewer
+  /// valid points than the cols it overwrites
   int Add(const LidarScan& scan);
 
+  /// @brief Whether a scan can be written in place, see Reserve()
+  bool CanReserve() const noexcept {
+    return layout == ScanLayout::kPacked && !destagger();
+  }
+  /// @brief Writable view of cols, so a scan can be decoded directly into this
+  /// sweep without an intermediate LidarScan, call Commit() when done
+  cv::Mat Reserve(const cv::Range& cols);
+  /// @brief Commit a scan written in place at cols by Reserve()
+  /// @return Change of num_points, see Add()
+  int Commit(double time, double dt, double scale, const cv::Range& cols);
+  /// @brief Copy scan cols [c0, c1) of row r to sweep cols starting at sc
+  /// @return Number of valid points copied
+  int CopyRow(const LidarScan& scan, int r, int c0, int c1, int sc);
+  /// @brief Recount valid points in cols and update num_points
+  /// @return Number of valid points in cols
+  int CountPoints(const cv::Range& cols);
+
+  /// @brief A view (no copy) of cols in curr, with rows aligned if destagger
+  LidarScan CurrView() const;
+
   /// @brief Interpolate pose of each column
-  void Interp(const Trajectory& traj, int gsize = 0);
+  /// @return Number of cells interpolated from scratch
+  int Interp(const Trajectory& traj, int gsize = 0);
+  /// @brief Interpolate pose of each column in cell gc between two knots
+  void InterpCell(int gc,
+                  int cell_width,
+                  const NavState& st0,
+                  const NavState& st1,
+                  const Sophus::SE3d& T_imu_lidar);
+  /// @brief Move pose of each column in cell gc by a knot correction
+  void CorrectCell(int gc,
+                   int cell_width,
+                   const NavState& st0,
+                   const NavState& st1,
+                   const KnotCorrection& corr);
 };
 
-LidarSweep MakeTestSweep(const cv::Size& size);
+LidarSweep MakeTestSweep(const cv::Size& size,
+                         ScanLayout layout = ScanLayout::kPacked);
 
 }  // namespace sv
@@ -29,35 +29,361 @@ TEST(ScanTest, TestAdd) {
   LidarScan scan = MakeTestScan({4, 4});
   scan.curr = {0, 4};
 
-  ls.Add(scan);
+  EXPECT_EQ(ls.Add(scan), 16);
+  EXPECT_EQ(ls.num_points, 16);
 
   EXPECT_EQ(ls.curr.start, 0);
   EXPECT_EQ(ls.curr.end, 4);
 
   scan.curr = {4, 8};
-  ls.Add(scan);
+  EXPECT_EQ(ls.Add(scan), 16);
+  EXPECT_EQ(ls.num_points, 32);
   EXPECT_EQ(ls.curr.start, 4);
   EXPECT_EQ(ls.curr.end, 8);
 
+  // Overwrite first half with a scan that has an invalid row
+  scan.mat.row(0).setTo(0);
   scan.curr = {0, 4};
-  ls.Add(scan);
+  EXPECT_EQ(ls.Add(scan), -4);
+  EXPECT_EQ(ls.num_points, 28);
+  EXPECT_EQ(ls.col_points.at(0), 3);
+  EXPECT_EQ(ls.col_points.at(4), 4);
   EXPECT_EQ(ls.curr.start, 0);
   EXPECT_EQ(ls.curr.end, 4);
 
   std::cout << ls << "\n";
 }
 
+TEST(ScanTest, TestPlanar) {
+  LidarSweep packed({8, 4});
+  LidarSweep planar({8, 4}, ScanLayout::kPlanar);
+  EXPECT_EQ(planar.type(), CV_16UC1);
+  EXPECT_EQ(planar.xyz.rows, 12);
+
+  LidarScan scan = MakeTestScan({4, 4});
+  scan.mat.row(0).setTo(0);
+  scan.curr = {0, 4};
+  EXPECT_EQ(packed.Add(scan), planar.Add(scan));
+  EXPECT_EQ(packed.num_points, planar.num_points);
+
+  for (int r = 0; r < packed.rows(); ++r) {
+    for (int c = 0; c < packed.cols(); ++c) {
+      const auto p0 = packed.PixelAt({c, r});
+      const auto p1 = planar.PixelAt({c, r});
+      EXPECT_EQ(p0.Ok(), p1.Ok());
+      if (!p0.Ok()) continue;
+      EXPECT_EQ(p0.Vec3fMap(), p1.Vec3fMap());
+      EXPECT_EQ(p0.range_raw, p1.range_raw);
+      EXPECT_EQ(packed.RangeAt({c, r}), planar.RangeAt({c, r}));
+    }
+  }
+
+  std::cout << planar << "\n";
+}
+
+TEST(ScanTest, TestCompact) {
+  const cv::Size size{8, 4};
+  LidarSweep packed(size);
+  LidarSweep compact(size, ScanLayout::kCompact, MakeTestBeams(size));
+  EXPECT_EQ(compact.type(), CV_16UC1);
+  EXPECT_TRUE(compact.xyz.empty());
+
+  LidarScan scan = MakeTestCompactScan(size);
+  scan.mat.row(0).setTo(0);
+  EXPECT_EQ(packed.Add(scan), compact.Add(scan));
+  EXPECT_EQ(packed.num_points, compact.num_points);
+
+  for (int r = 0; r < packed.rows(); ++r) {
+    for (int c = 0; c < packed.cols(); ++c) {
+      const auto p0 = packed.PixelAt({c, r});
+      const auto p1 = compact.PixelAt({c, r});
+      EXPECT_EQ(p0.range_raw, p1.range_raw);
+      EXPECT_EQ(p1.Ok(), p0.range_raw > 0);
+      if (!p1.Ok()) continue;
+      EXPECT_TRUE(p1.Vec3fMap().isApprox(p0.Vec3fMap(), 1e-5));
+    }
+  }
+
+  std::cout << compact << "\n";
+}
+
+TEST(ScanTest, TestCompactDestagger) {
+  const cv::Size size{8, 4};
+  const auto beams = MakeTestBeams(size);
+  LidarSweep compact(size, ScanLayout::kCompact, beams);
+  compact.SetShifts({2, 1, 4, 1});
+
+  // Beam of scan col c moves with its pixel to sweep col c + shift
+  for (int r = 0; r < size.height; ++r) {
+    for (int c = 0; c < size.width; ++c) {
+      const int sc = (c + compact.ShiftAt(r)) % size.width;
+      const auto& beam = beams.at<cv::Point3f>(r, c);
+      EXPECT_EQ(compact.BeamAt({sc, r}),
+                Eigen::Vector3f(beam.x, beam.y, beam.z));
+    }
+  }
+
+  // Setting shifts again is relative to the original beams
+  compact.SetShifts({});
+  for (int r = 0; r < size.height; ++r) {
+    for (int c = 0; c < size.width; ++c) {
+      const auto& beam = beams.at<cv::Point3f>(r, c);
+      EXPECT_EQ(compact.BeamAt({c, r}),
+                Eigen::Vector3f(beam.x, beam.y, beam.z));
+    }
+  }
+}
+
+TEST(ScanTest, TestReserve) {
+  LidarSweep ls0({8, 4});
+  LidarSweep ls1({8, 4});
+  EXPECT_TRUE(ls1.CanReserve());
+
+  LidarScan scan = MakeTestScan({4, 4});
+  scan.mat.row(0).setTo(0);
+  scan.curr = {0, 4};
+  const auto n0 = ls0.Add(scan);
+
+  // Reserve gives a view into sweep, so writing to it is writing to sweep
+  auto view = ls1.Reserve(scan.curr);
+  const auto* first = &ls1.mat.at<ScanPixel>(0, 0);
+  EXPECT_EQ(&view.at<ScanPixel>(0, 0), first);
+  scan.mat.copyTo(view);
+  EXPECT_EQ(&view.at<ScanPixel>(0, 0), first);
+  EXPECT_EQ(ls1.Commit(scan.time, scan.dt, scan.scale, scan.curr), n0);
+
+  EXPECT_EQ(ls0.num_points, ls1.num_points);
+  EXPECT_EQ(ls0.curr.start, ls1.curr.start);
+  EXPECT_EQ(ls0.time, ls1.time);
+  for (int r = 0; r < ls0.rows(); ++r) {
+    for (int c = 0; c < ls0.cols(); ++c) {
+      EXPECT_EQ(ls0.range.at<uint16_t>(r, c), ls1.range.at<uint16_t>(r, c));
+    }
+  }
+
+  ls1.SetShifts({0, 1, 0, 1});
+  EXPECT_FALSE(ls1.CanReserve());
+}
+
+TEST(ScanTest, TestDestagger) {
+  LidarSweep ls({8, 4});
+  ls.SetShifts({2, 1, 4, 1});
+  EXPECT_EQ(ls.shifts, std::vector<int>({1, 0, 3, 0}));
+  EXPECT_EQ(ls.max_shift, 3);
+
+  // Mark each pixel by its col in scan
+  LidarScan scan = MakeTestScan({4, 4});
+  for (int r = 0; r < scan.rows(); ++r) {
+    for (int c = 0; c < scan.cols(); ++c) {
+      scan.mat.at<ScanPixel>(r, c).intensity = c + 1;
+    }
+  }
+
+  scan.curr = {0, 4};
+  EXPECT_EQ(ls.Add(scan), 16);
+  EXPECT_EQ(ls.num_points, 16);
+  scan.curr = {4, 8};
+  EXPECT_EQ(ls.Add(scan), 16);
+  EXPECT_EQ(ls.num_points, 32);
+
+  // Row 2 of the second scan wraps around
+  for (int r = 0; r < ls.rows(); ++r) {
+    for (int c = 0; c < scan.cols(); ++c) {
+      const int sc = (4 + c + ls.shifts[r]) % ls.cols();
+      EXPECT_EQ(ls.PixelAt({sc, r}).intensity, c + 1);
+    }
+  }
+
+  // Pose of a pixel is that of its scan col, which wraps around as well
+  EXPECT_EQ(ls.PoseCol(5, 2), 2);
+  EXPECT_EQ(ls.PoseCol(1, 2), 6);
+  EXPECT_EQ(ls.PoseCol(5, 1), 5);
+
+  const auto view = ls.CurrView();
+  EXPECT_TRUE(view.destaggered);
+  EXPECT_EQ(view.cols(), 4);
+  EXPECT_EQ(view.curr.start, 4);
+  EXPECT_EQ(view.PixelAt({0, 2}).intensity, ls.PixelAt({4, 2}).intensity);
+}
+
+TEST(ScanTest, TestInterp) {
+  LidarSweep ls({8, 4});
+  Trajectory traj(5);
+  for (int i = 0; i < traj.size(); ++i) {
+    auto& st = traj.At(i);
+    st.rot = Sophus::SO3d::exp(Eigen::Vector3d{0.1, 0.2, 0.3} * i);
+    st.pos = Eigen::Vector3d{1.0, 2.0, 3.0} * i;
+  }
+  ls.Interp(traj);
+
+  const Eigen::Vector3f pt{1, 2, 3};
+  for (int c = 0; c < ls.cols(); ++c) {
+    const Eigen::Vector3f pt_p = ls.TfAt(c) * pt;
+    EXPECT_TRUE(ls.TransformAt(c, pt).isApprox(pt_p, 1e-6));
+  }
+}
+
+Trajectory MakeTestTraj(int size) {
+  Trajectory traj(size);
+  traj.T_imu_lidar.translation() = Eigen::Vector3d{0.1, 0.2, 0.3};
+  for (int i = 0; i < traj.size(); ++i) {
+    auto& st = traj.At(i);
+    st.time = 0.01 * i;
+    st.rot = Sophus::SO3d::exp(Eigen::Vector3d{0.1, 0.2, 0.3} * i);
+    st.pos = Eigen::Vector3d{1.0, 2.0, 3.0} * i;
+  }
+  return traj;
+}
+
+void ExpectSameTfs(const LidarSweep& ls, const Trajectory& traj) {
+  LidarSweep full(ls.size());
+  full.curr = ls.curr;
+  full.Interp(traj);
+  for (int c = 0; c < ls.cols(); ++c) {
+    EXPECT_TRUE(ls.Tf34At(c).isApprox(full.Tf34At(c), 1e-5)) << c;
+  }
+}
+
+TEST(ScanTest, TestInterpIncremental) {
+  LidarSweep ls({64, 4});
+  ls.curr = {0, 16};
+  auto traj = MakeTestTraj(9);
+
+  EXPECT_EQ(ls.Interp(traj), 8);
+  EXPECT_EQ(ls.Interp(traj), 0);
+  ExpectSameTfs(ls, traj);
+
+  // Rigid move of the whole traj
+  const Sophus::SE3d tf{Sophus::SO3d::exp({0.1, -0.2, 0.3}), {1, 2, 3}};
+  traj.MoveFrame(tf);
+  EXPECT_EQ(ls.Interp(traj), 0);
+  ExpectSameTfs(ls, traj);
+
+  // Correct first state and velocity then repredict
+  const Sophus::SO3d eR = Sophus::SO3d::exp({0.01, 0.02, -0.01});
+  const Eigen::Vector3d a{0.1, 0.0, -0.1};
+  const Eigen::Vector3d b{1.0, -2.0, 0.5};
+  for (auto& st : traj.states) {
+    st.rot = eR * st.rot;
+    st.pos = eR * st.pos + a + b * st.time;
+  }
+  EXPECT_EQ(ls.Interp(traj), 0);
+  ExpectSameTfs(ls, traj);
+
+  // Change a single knot, which affects two cells
+  traj.At(4).pos.x() += 1.0;
+  EXPECT_EQ(ls.Interp(traj), 2);
+  ExpectSameTfs(ls, traj);
+
+  // Force full
+  ls.knots.clear();
+  EXPECT_EQ(ls.Interp(traj), 8);
+
+  // Cells are re-anchored after too many corrections
+  const Sophus::SE3d dtf{Sophus::SO3d::exp({0.01, 0.02, 0.03}), {0.1, 0, 0}};
+  for (int i = 0; i < 16; ++i) {
+    traj.MoveFrame(dtf);
+    EXPECT_EQ(ls.Interp(traj), 0) << i;
+  }
+  traj.MoveFrame(dtf);
+  EXPECT_EQ(ls.Interp(traj), 8);
+  ExpectSameTfs(ls, traj);
+}
+
+TEST(ScanTest, TestInterpStep) {
+  // Single cell with a large rotation is the worst case for stepping
+  LidarSweep exact({1024, 4});
+  exact.interp_exp = true;
+  LidarSweep step({1024, 4});
+
+  Trajectory traj(2);
+  traj.At(1).rot = Sophus::SO3d::exp({0.5, -1.0, 1.5});
+  traj.At(1).pos = {1.0, 2.0, 3.0};
+  exact.Interp(traj);
+  step.Interp(traj);
+
+  double max_drift = 0;
+  for (int c = 0; c < exact.cols(); ++c) {
+    const auto& tf0 = exact.TfAt(c);
+    const auto& tf1 = step.TfAt(c);
+    const auto drift = (tf0.so3().inverse() * tf1.so3()).log().norm();
+    max_drift = std::max<double>(max_drift, drift);
+    EXPECT_TRUE(tf0.translation().isApprox(tf1.translation(), 1e-6));
+  }
+  // Float precision of the cached poses
+  EXPECT_LT(max_drift, 1e-6);
+}
+
 void BM_SweepAdd(benchmark::State& state) {
   const cv::Size size{1024, 64};
+  const int width = state.range(0);
   LidarSweep sweep(size);
-  LidarScan scan = MakeTestScan(size);
+  LidarScan scan = MakeTestScan({width, size.height});
 
   for (auto _ : state) {
+    scan.curr.start = sweep.curr.end % size.width;
+    scan.curr.end = scan.curr.start + width;
     auto n = sweep.Add(scan);
     benchmark::DoNotOptimize(n);
   }
 }
-BENCHMARK(BM_SweepAdd);
+BENCHMARK(BM_SweepAdd)->Arg(16)->Arg(64)->Arg(1024);
+
+void BM_SweepAddCopy(benchmark::State& state) {
+  // Incoming data as received, add through a freshly copied scan
+  const cv::Size size{1024, 64};
+  const int width = state.range(0);
+  LidarSweep sweep(size);
+  const auto data = MakeTestScan({width, size.height});
+
+  for (auto _ : state) {
+    const int start = sweep.curr.end % size.width;
+    const LidarScan scan{
+        data.time, data.dt, data.scale, data.mat.clone(), {start, start + width}};
+    auto n = sweep.Add(scan);
+    benchmark::DoNotOptimize(n);
+  }
+}
+BENCHMARK(BM_SweepAddCopy)->Arg(16)->Arg(64)->Arg(1024);
+
+void BM_SweepReserve(benchmark::State& state) {
+  // Incoming data as received, decode into sweep in place
+  const cv::Size size{1024, 64};
+  const int width = state.range(0);
+  LidarSweep sweep(size);
+  const auto data = MakeTestScan({width, size.height});
+
+  for (auto _ : state) {
+    const int start = sweep.curr.end % size.width;
+    const cv::Range curr{start, start + width};
+    data.mat.copyTo(sweep.Reserve(curr));
+    auto n = sweep.Commit(data.time, data.dt, data.scale, curr);
+    benchmark::DoNotOptimize(n);
+  }
+}
+BENCHMARK(BM_SweepReserve)->Arg(16)->Arg(64)->Arg(1024);
+
+void BM_SweepAddLayout(benchmark::State& state) {
+  const cv::Size size(state.range(0), state.range(1));
+  const auto layout = static_cast<ScanLayout>(state.range(2));
+  const int width = 16;
+  LidarSweep sweep(size, layout, MakeTestBeams(size));
+  LidarScan scan = MakeTestScan({width, size.height});
+
+  for (auto _ : state) {
+    scan.curr.start = sweep.curr.end % size.width;
+    scan.curr.end = scan.curr.start + width;
+    auto n = sweep.Add(scan);
+    benchmark::DoNotOptimize(n);
+  }
+}
+BENCHMARK(BM_SweepAddLayout)
+    ->Args({1024, 64, static_cast<int>(ScanLayout::kPacked)})
+    ->Args({1024, 64, static_cast<int>(ScanLayout::kPlanar)})
+    ->Args({1024, 64, static_cast<int>(ScanLayout::kCompact)})
+    ->Args({2048, 128, static_cast<int>(ScanLayout::kPacked)})
+    ->Args({2048, 128, static_cast<int>(ScanLayout::kPlanar)})
+    ->Args({2048, 128, static_cast<int>(ScanLayout::kCompact)});
 
 void BM_SweepInterp(benchmark::State& state) {
   LidarSweep sweep({1024, 64});
@@ -65,11 +391,44 @@ void BM_SweepInterp(benchmark::State& state) {
   int gsize = state.range(0);
 
   for (auto _ : state) {
+    sweep.knots.clear();
     sweep.Interp(traj, gsize);
     benchmark::DoNotOptimize(sweep);
   }
 }
 BENCHMARK(BM_SweepInterp)->Arg(0)->Arg(1)->Arg(2)->Arg(4);
 
+void BM_SweepInterpKernel(benchmark::State& state) {
+  LidarSweep sweep({1024, 64});
+  sweep.interp_exp = state.range(0);
+  const auto traj = MakeTestTraj(65);
+
+  for (auto _ : state) {
+    sweep.knots.clear();
+    sweep.Interp(traj);
+    benchmark::DoNotOptimize(sweep);
+  }
+}
+BENCHMARK(BM_SweepInterpKernel)->Arg(0)->Arg(1);
+
+void BM_SweepInterpIncremental(benchmark::State& state) {
+  LidarSweep sweep({1024, 64});
+  auto traj = MakeTestTraj(65);
+  const int num_new = state.range(0);
+  sweep.Interp(traj);
+
+  const Sophus::SE3d tf{Sophus::SO3d::exp({1e-3, 0, 0}), {1e-3, 0, 0}};
+  for (auto _ : state) {
+    // Move whole traj and repredict newest segments
+    traj.MoveFrame(tf);
+    for (int i = traj.size() - num_new; i < traj.size(); ++i) {
+      traj.At(i).pos.x() += 1e-3;
+    }
+    auto n = sweep.Interp(traj);
+    benchmark::DoNotOptimize(n);
+  }
+}
+BENCHMARK(BM_SweepInterpIncremental)->Arg(1)->Arg(4)->Arg(16)->Arg(64);
+
 }  // namespace
 }  // namespace sv
@@ -12,6 +12,82 @@ using SE3d = Sophus::SE3d;
 using Vector3d = Eigen::Vector3d;
 using Quaterniond = Eigen::Quaterniond;
 
+/// KnotCorrection =============================================================
+KnotCorrection::KnotCorrection(const NavState& old0,
+                               const NavState& new0,
+                               const NavState& old1,
+                               const NavState& new1)
+    : rot{new0.rot * old0.rot.inverse()}, t0{new0.time} {
+  a = new0.pos - rot * old0.pos;
+  const auto dt = new1.time - new0.time;
+  if (dt > 0) b = (new1.pos - rot * old1.pos - a) / dt;
+}
+
+bool KnotCorrection::Explains(const NavState& st0, const NavState& st1) const {
+  // Knots are in double and corrections are exact up to round off
+  constexpr double kTol = 1e-9;
+  if (st0.time != st1.time) return false;
+  const auto dr = (st1.rot * (rot * st0.rot).inverse()).log();
+  const Vector3d dp = st1.pos - (rot * st0.pos + TransAt(st1.time));
+  return dr.norm() < kTol && dp.norm() < kTol;
+}
+
+bool SameKnot(const NavState& st0, const NavState& st1) {
+  return st0.time == st1.time && st0.pos == st1.pos &&
+         st0.rot.unit_quaternion().coeffs() ==
+             st1.rot.unit_quaternion().coeffs();
+}
+
+/// KnotCache ==================================================================
+bool KnotCache::Update(const Trajectory& traj, int grid_end) {
+  const int num_cells = traj.size() - 1;
+
+  // Cached knots are only valid for the same number of cells and extrinsics
+  cached = size() == num_cells &&
+           T_imu_lidar.matrix3x4() == traj.T_imu_lidar.matrix3x4();
+  if (!cached) {
+    knots.resize(num_cells);
+    num_corrs.assign(num_cells, 0);
+    T_imu_lidar = traj.T_imu_lidar;
+    corr = {};
+    return false;
+  }
+
+  // The oldest cell (first segment of traj) is never newly predicted, so it
+  // tells us how the whole traj moved since last time (e.g. after icp)
+  const auto& kn = knots.at(grid_end % num_cells);
+  corr = KnotCorrection(kn.first, traj.At(0), kn.second, traj.At(1));
+  return true;
+}
+
+KnotCache::Action KnotCache::Update(int gc,
+                                    const NavState& st0,
+                                    const NavState& st1) {
+  auto& kn = knots.at(gc);
+  auto& nc = num_corrs.at(gc);
+
+  if (cached) {
+    // Nothing changed
+    if (SameKnot(kn.first, st0) && SameKnot(kn.second, st1)) {
+      return Action::kKeep;
+    }
+
+    // Knots are moved by corr, so are the poses of this cell, unless it has
+    // been corrected too many times and needs re-anchoring
+    if (nc < kMaxCorrections && corr.Explains(kn.first, st0) &&
+        corr.Explains(kn.second, st1)) {
+      kn = {st0, st1};
+      ++nc;
+      return Action::kCorrect;
+    }
+  }
+
+  kn = {st0, st1};
+  nc = 0;
+  return Action::kInterp;
+}
+
+/// Trajectory =================================================================
 Trajectory::Trajectory(int size, const TrajectoryParams& params)
     : gravity_norm{params.gravity_norm},
       use_acc{params.use_acc},
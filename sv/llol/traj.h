@@ -10,6 +10,61 @@ struct TrajectoryParams {
   double gravity_norm{0.0};
 };
 
+/// @struct Correction [R | a + b * (t - t0)] that moves old knots of a
+/// trajectory to new ones. MoveFrame() is rigid (b = 0), while re-predicting
+/// from a corrected first state with a corrected velocity adds a translation
+/// that is linear in time.
+struct KnotCorrection {
+  KnotCorrection() = default;
+  /// @brief Estimate from two consecutive knots before and after
+  KnotCorrection(const NavState& old0,
+                 const NavState& new0,
+                 const NavState& old1,
+                 const NavState& new1);
+
+  Eigen::Vector3d TransAt(double t) const { return a + b * (t - t0); }
+  /// @brief Whether knot st1 is knot st0 moved by this correction
+  bool Explains(const NavState& st0, const NavState& st1) const;
+
+  Sophus::SO3d rot{};
+  Eigen::Vector3d a{kVecZero3d};
+  Eigen::Vector3d b{kVecZero3d};
+  double t0{};
+};
+
+/// @brief Whether two knots are exactly the same
+bool SameKnot(const NavState& st0, const NavState& st1);
+
+struct Trajectory;
+
+/// @struct Knots (start, end) of each cell used in the last interpolation of a
+/// sweep or grid, so that only cells whose knots changed are updated. Cells
+/// whose knots were only moved by a KnotCorrection (e.g. after icp) can be
+/// corrected instead, but at most kMaxCorrections times in a row, which bounds
+/// the round off of composing float corrections. Clear to force a full update.
+struct KnotCache {
+  enum class Action { kKeep, kCorrect, kInterp };
+  static constexpr int kMaxCorrections = 16;
+
+  /// @brief Prepare for interpolating traj, grid_end is the cell where traj
+  /// starts. Resets the cache if the number of cells or extrinsics changed.
+  /// @return Whether the cache is valid, otherwise all cells are interpolated
+  bool Update(const Trajectory& traj, int grid_end);
+  /// @brief Record new knots of cell gc, safe to call in parallel for
+  /// different cells after Update(traj, grid_end)
+  /// @return What to do with the poses of cell gc
+  Action Update(int gc, const NavState& st0, const NavState& st1);
+
+  int size() const noexcept { return static_cast<int>(knots.size()); }
+  void clear() noexcept { knots.clear(); }
+
+  std::vector<std::pair<NavState, NavState>> knots;
+  std::vector<int> num_corrs;  // corrections of each cell since last interp
+  Sophus::SE3d T_imu_lidar{};  // extrinsics used in the last interpolation
+  KnotCorrection corr;         // how traj moved since the last interpolation
+  bool cached{};
+};
+
 /// @brief Accumulates imu data and integrate
 /// @todo for now only integrate gyro for rotation
 struct Trajectory {
@@ -1,6 +1,7 @@
 #include "sv/node/conv.h"
 
-#include <cv_bridge/cv_bridge.h>
+#include <glog/logging.h>
+#include <sensor_msgs/image_encodings.h>
 #include <tf2_eigen/tf2_eigen.h>
 
 namespace sv {
@@ -34,21 +35,82 @@ ImuData MakeImu(const sensor_msgs::Imu& imu_msg) {
   return imu;
 }
 
-LidarScan MakeScan(const sensor_msgs::Image& image_msg,
-                   const sensor_msgs::CameraInfo& cinfo_msg) {
-  cv_bridge::CvImageConstPtr cv_ptr;
-  cv_ptr = cv_bridge::toCvCopy(image_msg, "32FC4");
-
-  return {image_msg.header.stamp.toSec(),    // t
-          cinfo_msg.K[0],                    // dt
-          cinfo_msg.R[0],                    // scale
-          cv_ptr->image,                     // xyzr
-          cv::Range(cinfo_msg.roi.x_offset,  // col_rg
-                    cinfo_msg.roi.x_offset + cinfo_msg.roi.width)};
+bool MakeScan(const sensor_msgs::Image& image_msg,
+              const sensor_msgs::CameraInfo& cinfo_msg,
+              ScanPool& pool,
+              LidarScan& scan) {
+  const bool hit =
+      pool.Acquire(cv::Size(image_msg.width, image_msg.height), scan);
+  DecodeScan(image_msg, scan.mat);
+  scan.Reset(image_msg.header.stamp.toSec(),  // t
+             cinfo_msg.K[0],                  // dt
+             cinfo_msg.R[0],                  // scale
+             MakeScanCols(cinfo_msg));        // col_rg
+  return hit;
 }
 
-LidarSweep MakeSweep(const sensor_msgs::CameraInfo& cinfo_msg) {
-  return LidarSweep{cv::Size(cinfo_msg.width, cinfo_msg.height)};
+cv::Range MakeScanCols(const sensor_msgs::CameraInfo& cinfo_msg) {
+  return {static_cast<int>(cinfo_msg.roi.x_offset),
+          static_cast<int>(cinfo_msg.roi.x_offset + cinfo_msg.roi.width)};
+}
+
+void DecodeScan(const sensor_msgs::Image& image_msg, cv::Mat dst) {
+  CHECK_EQ(image_msg.encoding, sensor_msgs::image_encodings::TYPE_32FC4);
+  CHECK(!image_msg.is_bigendian) << "Big endian scan is not supported";
+  CHECK_EQ(dst.type(), LidarScan::kDtype);
+  CHECK_EQ(dst.rows, static_cast<int>(image_msg.height));
+  CHECK_EQ(dst.cols, static_cast<int>(image_msg.width));
+
+  // Wrap message data without copy, then copy once into dst, which does not
+  // reallocate since size and type match
+  const cv::Mat src(image_msg.height,
+                    image_msg.width,
+                    LidarScan::kDtype,
+                    const_cast<uint8_t*>(image_msg.data.data()),
+                    image_msg.step);
+  src.copyTo(dst);
+}
+
+LidarSweep InitSweep(const ros::NodeHandle& pnh,
+                     const sensor_msgs::CameraInfo& cinfo_msg) {
+  const cv::Size size(cinfo_msg.width, cinfo_msg.height);
+  const auto layout_str = pnh.param<std::string>("layout", "packed");
+
+  LidarSweep sweep;
+  if (layout_str == "planar") {
+    sweep = LidarSweep{size, ScanLayout::kPlanar};
+  } else if (layout_str == "compact") {
+    // Compact sweep needs beam directions that match the sensor, prefer per
+    // beam angles from lidar metadata, otherwise fall back to a uniform model
+    const auto altitudes =
+        pnh.param<std::vector<double>>("beam_altitude_angles", {});
+    const auto azimuths =
+        pnh.param<std::vector<double>>("beam_azimuth_angles", {});
+    cv::Mat beams;
+    if (!altitudes.empty()) {
+      beams = MakeBeams(size, altitudes, azimuths);
+    } else {
+      const auto vfov = Deg2Rad(pnh.param<double>("vfov", 0.0));
+      CHECK_GT(vfov, 0) << "Compact sweep requires beam angles or vfov";
+      beams = MakeBeams(LidarModel{size, vfov});
+    }
+    sweep = LidarSweep{size, ScanLayout::kCompact, beams};
+  } else {
+    CHECK_EQ(layout_str, "packed") << "Unknown sweep layout";
+    sweep = LidarSweep{size};
+  }
+
+  sweep.interp_exp = pnh.param<bool>("interp_exp", sweep.interp_exp);
+  // Per row pixel shifts from lidar metadata, empty means no destagger
+  sweep.SetShifts(pnh.param<std::vector<int>>("pixel_shifts", {}));
+  return sweep;
+}
+
+ScanPool InitScanPool(const ros::NodeHandle& pnh,
+                      const sensor_msgs::CameraInfo& cinfo_msg) {
+  // Pooled scans have the size of a packet
+  const cv::Size size(cinfo_msg.roi.width, cinfo_msg.height);
+  return {size, pnh.param<int>("pool_capacity", 2)};
 }
 
 SweepGrid InitGrid(const ros::NodeHandle& pnh, const cv::Size& sweep_size) {
@@ -58,6 +120,10 @@ SweepGrid InitGrid(const ros::NodeHandle& pnh, const cv::Size& sweep_size) {
   gp.max_curve = pnh.param<double>("max_curve", gp.max_curve);
   gp.max_var = pnh.param<double>("max_var", gp.max_var);
   gp.nms = pnh.param<bool>("nms", gp.nms);
+  gp.nms_3x3 = pnh.param<bool>("nms_3x3", gp.nms_3x3);
+  gp.max_cands = pnh.param<int>("max_cands", gp.max_cands);
+  gp.bucket_rows = pnh.param<int>("bucket_rows", gp.bucket_rows);
+  gp.bucket_cols = pnh.param<int>("bucket_cols", gp.bucket_cols);
   return SweepGrid{sweep_size, gp};
 }
 
@@ -75,6 +141,8 @@ DepthPano InitPano(const ros::NodeHandle& pnh) {
   pp.align_gravity = pnh.param<bool>("align_gravity", pp.align_gravity);
   pp.min_match_ratio = pnh.param<double>("min_match_ratio", pp.min_match_ratio);
   pp.max_translation = pnh.param<double>("max_translation", pp.max_translation);
+  pp.cache_xyz = pnh.param<bool>("cache_xyz", pp.cache_xyz);
+  if (pnh.param<bool>("fast_proj", false)) pp.proj_mode = ProjMode::kFast;
   return DepthPano({pano_cols, pano_rows}, pp);
 }
 
@@ -87,6 +155,7 @@ GicpSolver InitGicp(const ros::NodeHandle& pnh) {
   gp.cov_lambda = pnh.param<double>("cov_lambda", gp.cov_lambda);
   gp.imu_weight = pnh.param<double>("imu_weight", gp.imu_weight);
   gp.min_eigval = pnh.param<double>("min_eigval", gp.min_eigval);
+  gp.max_matches = pnh.param<int>("max_matches", gp.max_matches);
   return GicpSolver{gp};
 }
 
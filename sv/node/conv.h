@@ -23,11 +23,24 @@ void SO3dToMsg(const Sophus::SO3d& so3, geometry_msgs::Quaternion& q);
 
 /// @brief Factory methods
 ImuData MakeImu(const sensor_msgs::Imu& imu_msg);
-LidarScan MakeScan(const sensor_msgs::Image& image_msg,
-                   const sensor_msgs::CameraInfo& cinfo_msg);
-LidarSweep MakeSweep(const sensor_msgs::CameraInfo& cinfo_msg);
+/// @brief Decode image into a scan taken from pool, which reuses both its mat
+/// and its range plane, so nothing is allocated per packet on a pool hit
+/// @return True if scan is from pool, false if it is a miss
+bool MakeScan(const sensor_msgs::Image& image_msg,
+              const sensor_msgs::CameraInfo& cinfo_msg,
+              ScanPool& pool,
+              LidarScan& scan);
+/// @brief Col range of a scan in sweep
+cv::Range MakeScanCols(const sensor_msgs::CameraInfo& cinfo_msg);
+/// @brief Decode image into an allocated mat of the same size (e.g. a view
+/// from LidarSweep::Reserve()), with a single copy and no allocation
+void DecodeScan(const sensor_msgs::Image& image_msg, cv::Mat dst);
 
 ImuQueue InitImuq(const ros::NodeHandle& pnh);
+LidarSweep InitSweep(const ros::NodeHandle& pnh,
+                     const sensor_msgs::CameraInfo& cinfo_msg);
+ScanPool InitScanPool(const ros::NodeHandle& pnh,
+                      const sensor_msgs::CameraInfo& cinfo_msg);
 Trajectory InitTraj(const ros::NodeHandle& pnh, int grid_cols);
 SweepGrid InitGrid(const ros::NodeHandle& pnh, const cv::Size& sweep_size);
 DepthPano InitPano(const ros::NodeHandle& pnh);
@@ -53,14 +53,15 @@ bool OdomNode::IcpRigid() {
   opts.min_eigenvalue = gicp_.min_eigval;
 
   bool icp_ok = false;
+  int n_matches = 0;
 
   for (int i = 0; i < gicp_.outer_iters; ++i) {
     cost.ResetError();
 
     t_match.Resume();
     // Need to update cell tfs before match
-    grid_.Interp(traj_);
-    const auto n_matches = gicp_.Match(grid_, pano_, tbb_);
+    grid_.Interp(traj_, tbb_);
+    n_matches = gicp_.Match(grid_, pano_, tbb_);
     t_match.Stop(false);
 
     if (n_matches < 10) {
@@ -73,6 +74,7 @@ bool OdomNode::IcpRigid() {
     // Build
     t_solve.Resume();
     cost.UpdateMatches(grid_);
+    cost.SelectMatches(gicp_.max_matches);
     solver.Solve(cost, cost.error.data());
     cost.UpdateTraj(traj_);
     // Repropagate full trajectory from the starting point
@@ -98,7 +100,9 @@ bool OdomNode::IcpRigid() {
   // TODO (chao): need a better api
   traj_.cov = solver.GetJtJ().inverse();
   ROS_DEBUG_STREAM(solver.summary.Report());
-  sm_.GetRef("grid.matches").Add(cost.matches.size());
+  // Render check uses all matches, not only the ones selected for solve
+  sm_.GetRef("grid.matches").Add(n_matches);
+  sm_.GetRef("grid.selected").Add(cost.matches.size());
 
   return icp_ok;
 }
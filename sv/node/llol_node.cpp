@@ -26,6 +26,10 @@ OdomNode::OdomNode(const ros::NodeHandle& pnh)
   log_ = pnh_.param<int>("log", 0);
   ROS_INFO_STREAM("Log interval: " << log_);
 
+  async_render_ = pnh_.param<bool>("async_render", false);
+  ROS_INFO_STREAM("Render: " << (async_render_ ? "Async" : "Sync"));
+  renderer_.gsize = tbb_;
+
   rigid_ = pnh_.param<bool>("rigid", true);
   ROS_WARN_STREAM("GICP: " << (rigid_ ? "Rigid" : "Linear"));
 
@@ -113,10 +117,18 @@ void OdomNode::ImuCb(const sensor_msgs::Imu& imu_msg) {
 
 void OdomNode::Initialize(const sensor_msgs::CameraInfo& cinfo_msg) {
   ROS_INFO_STREAM("+++ Initializing");
-  sweep_ = MakeSweep(cinfo_msg);
+  sweep_ = InitSweep({pnh_, "sweep"}, cinfo_msg);
   ROS_INFO_STREAM(sweep_);
 
+  // Scans are only allocated when they cannot be decoded into sweep in place
+  if (!sweep_.CanReserve()) {
+    pool_ = InitScanPool({pnh_, "sweep"}, cinfo_msg);
+    ROS_INFO_STREAM(pool_);
+  }
+
   grid_ = InitGrid({pnh_, "grid"}, sweep_.size());
+  // Cells of a destaggered sweep take their pose from the shifted scan cols
+  grid_.SetShifts(sweep_.shifts);
   ROS_INFO_STREAM(grid_);
 
   traj_ = InitTraj({pnh_, "traj"}, grid_.cols());
@@ -164,48 +176,75 @@ void OdomNode::CameraCb(const sensor_msgs::ImageConstPtr& image_msg,
   }
 
   // We can always process incoming scan no matter what
-  const auto scan = MakeScan(*image_msg, *cinfo_msg);
+  const auto curr = MakeScanCols(*cinfo_msg);
   ROS_DEBUG("Processing scan %d: [%d,%d)",
             static_cast<int>(cinfo_msg->header.seq),
-            scan.curr.start,
-            scan.curr.end);
-  // Add scan to sweep, compute score and filter
-  Preprocess(scan);
+            curr.start,
+            curr.end);
+  {  // Latency of the whole packet, its max shows stalls from rendering
+    auto _ = tm_.Scoped(async_render_ ? "Packet.AsyncRender" : "Packet");
+    // Add scan to sweep, compute score and filter
+    Preprocess(*image_msg, *cinfo_msg);
 
-  Register();
+    Register();
 
-  PostProcess();
+    PostProcess();
+  }
 
   Logging();
 
   Publish(cinfo_msg->header);
 }
 
-void OdomNode::Preprocess(const LidarScan& scan) {
+void OdomNode::Preprocess(const sensor_msgs::Image& image_msg,
+                          const sensor_msgs::CameraInfo& cinfo_msg) {
+  const auto curr = MakeScanCols(cinfo_msg);
+
   // 1. Eject scan to pano, assuming traj is optimized
   int n_added = 0;
   {  // Note that at this point the new scan is not yet added to the sweep
     auto _ = tm_.Scoped("1.Pano.Add");
-    n_added = pano_.Add(sweep_, scan.curr, tbb_);
+    n_added = renderer_.Add(pano_, sweep_, curr, tbb_);
   }
   sm_.GetRef("pano.add_points").Add(n_added);
   ROS_DEBUG_STREAM("[pano.Add] num added: " << n_added);
 
   // 2. Add current scan to sweep
   int n_points = 0;
+  LidarScan scan;  // only used when sweep cannot be written in place
   {  // Add scan to sweep
     auto _ = tm_.Scoped("2.Sweep.Add");
-    n_points = sweep_.Add(scan);
+    if (sweep_.CanReserve()) {
+      // Decode directly into sweep, which saves an allocation and a copy
+      DecodeScan(image_msg, sweep_.Reserve(curr));
+      n_points = sweep_.Commit(image_msg.header.stamp.toSec(),
+                               cinfo_msg.K[0],
+                               cinfo_msg.R[0],
+                               curr);
+    } else {
+      // Decode into a pooled scan to avoid allocation per packet
+      const bool hit = MakeScan(image_msg, cinfo_msg, pool_, scan);
+      sm_.GetRef("scan.pool_miss").Add(!hit);
+      n_points = sweep_.Add(scan);
+    }
   }
   sm_.GetRef("sweep.add").Add(n_points);
-  ROS_DEBUG_STREAM("[sweep.Add] num added: " << n_points);
+  sm_.GetRef("sweep.points").Add(sweep_.num_points);
+  ROS_DEBUG_STREAM("[sweep.Add] num points change: " << n_points);
 
   // 3. Add current scan to grid
   cv::Vec2i n_cells{};
   {  // Reduce scan to grid and Filter
     auto _ = tm_.Scoped("3.Grid.Add");
-    n_cells = grid_.Add(scan, tbb_);
+    // With destagger, rows of a cell are only aligned in sweep
+    if (scan.empty() || sweep_.destagger()) {
+      n_cells = grid_.Add(sweep_.CurrView(), tbb_);
+    } else {
+      n_cells = grid_.Add(scan, tbb_);
+    }
   }
+  // Scan is no longer needed once it is in sweep and grid
+  if (!scan.empty()) pool_.Release(std::move(scan));
   ROS_DEBUG_STREAM("[grid.Add] Num valid cells: "
                    << n_cells[0] << ", num good cells: " << n_cells[1]);
 
@@ -230,8 +269,8 @@ void OdomNode::Preprocess(const LidarScan& scan) {
     const auto& disps = grid_.DrawCurveVar();
 
     Imshow("scan",
-           ApplyCmap(scan.ExtractRange(),
-                     1.0 / scan.scale / kMaxRange,
+           ApplyCmap(sweep_.range.colRange(sweep_.curr),
+                     1.0 / sweep_.scale / kMaxRange,
                      cv::COLORMAP_PINK,
                      0));
     Imshow("curve", ApplyCmap(disps[0], 1 / 0.25, cv::COLORMAP_JET));
@@ -256,7 +295,16 @@ void OdomNode::PostProcess() {
   const auto T_p2_p1 = T_p1_p2.inverse();
 
   int n_render = 0;
-  if (pano_.ShouldRender(T_p2_p1, match_ratio)) {
+  if (renderer_.ready()) {
+    // Background render is done, swap it in at this packet boundary
+    auto _ = tm_.Scoped("Render.Swap");
+    n_render = renderer_.Finish(pano_);
+    sm_.GetRef("pano.render_replayed_sweeps").Add(renderer_.num_replayed);
+    // Save current pano pose
+    T_odom_pano_ = traj_.T_odom_pano;
+    // Move traj to the pano frame where the render was started
+    traj_.MoveFrame(renderer_.tf_p2_p1);
+  } else if (!renderer_.busy() && pano_.ShouldRender(T_p2_p1, match_ratio)) {
     ROS_WARN_STREAM(
         "=Render= " << fmt::format(
             "sweeps: {:2.3f}, trans: {:.3f}, match: {:.2f}% = {}/{}",
@@ -266,15 +314,20 @@ void OdomNode::PostProcess() {
             num_matches,
             num_good_cells));
 
-    // TODO (chao): need to think about how to run this in background without
-    // interfering with odom
-    auto _ = tm_.Scoped("Render");
-    // Render pano at the latest lidar pose wrt pano (T_p1_p2 = T_p1_lidar)
-    n_render = pano_.Render(T_p2_p1.cast<float>(), tbb_);
-    // Save current pano pose
-    T_odom_pano_ = traj_.T_odom_pano;
-    // Once rendering is done we need to update traj accordingly
-    traj_.MoveFrame(T_p2_p1);
+    if (async_render_) {
+      // Render a snapshot in background while odom keeps matching against
+      // the current pano, traj is moved once it is swapped in
+      auto _ = tm_.Scoped("Render.Start");
+      renderer_.Start(pano_, T_p2_p1);
+    } else {
+      auto _ = tm_.Scoped("Render");
+      // Render pano at the latest lidar pose wrt pano (T_p1_p2 = T_p1_lidar)
+      n_render = pano_.Render(T_p2_p1.cast<float>(), tbb_);
+      // Save current pano pose
+      T_odom_pano_ = traj_.T_odom_pano;
+      // Once rendering is done we need to update traj accordingly
+      traj_.MoveFrame(T_p2_p1);
+    }
   }
   if (n_render > 0) {
     sm_.GetRef("pano.render_points").Add(n_render);
@@ -282,16 +335,18 @@ void OdomNode::PostProcess() {
   }
 
   // 7. Update sweep transforms for undistortion
+  int n_interp = 0;
   {
     auto _ = tm_.Scoped("7.Sweep.Interp");
-    sweep_.Interp(traj_, tbb_);
+    n_interp = sweep_.Interp(traj_, tbb_);
   }
+  sm_.GetRef("sweep.interp_cells").Add(n_interp);
 
-  grid_.Interp(traj_);
+  grid_.Interp(traj_, tbb_);
 
   if (vis_) {
     Imshow("sweep",
-           ApplyCmap(sweep_.ExtractRange(),
+           ApplyCmap(sweep_.range,
                      1.0 / sweep_.scale / kMaxRange,
                      cv::COLORMAP_PINK,
                      0));
@@ -312,6 +367,7 @@ void OdomNode::Logging() {
   for (const auto& kv : tm_.dict()) {
     if (absl::StartsWith(kv.first, "Total")) continue;
     if (absl::StartsWith(kv.first, "Render")) continue;
+    if (absl::StartsWith(kv.first, "Packet")) continue;
     time += kv.second.last();
   }
   stats.Add(time);
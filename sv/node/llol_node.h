@@ -23,6 +23,7 @@ struct OdomNode {
   int tbb_{0};
   int log_{0};
   bool vis_{true};
+  bool async_render_{false};
 
   bool rigid_{false};
   bool tf_init_{false};
@@ -41,8 +42,10 @@ struct OdomNode {
   ImuQueue imuq_;
   Trajectory traj_;
   LidarSweep sweep_;
+  ScanPool pool_;
   SweepGrid grid_;
   DepthPano pano_;
+  PanoRenderer renderer_;
   GicpSolver gicp_;
   std::optional<Sophus::SE3d> pano_pose_;
   std::optional<Sophus::SE3d> T_odom_pano_;
@@ -60,7 +63,8 @@ struct OdomNode {
   void Logging();
 
   void Initialize(const sensor_msgs::CameraInfo& cinfo_msg);
-  void Preprocess(const LidarScan& scan);
+  void Preprocess(const sensor_msgs::Image& image_msg,
+                  const sensor_msgs::CameraInfo& cinfo_msg);
   void Register();
   bool IcpRigid();
   void PostProcess();
@@ -30,7 +30,9 @@ void Pano2Cloud(const DepthPano& pano,
                             continue;
                           }
 
-                          const auto pp = pano.model.Backward(r, c, rg);
+                          const auto pp = pano.cache_xyz
+                                              ? pano.PointAt({c, r})
+                                              : pano.model.Backward(r, c, rg);
                           pc.x = pp.x;
                           pc.y = pp.y;
                           pc.z = pp.z;
@@ -53,6 +55,46 @@ void Sweep2Cloud(const LidarSweep& sweep,
   tbb::parallel_for(
       tbb::blocked_range<int>(0, size.height), [&](const auto& blk) {
         for (int r = blk.begin(); r < blk.end(); ++r) {
+          if (sweep.layout == ScanLayout::kPlanar) {
+            // Fast path, read planes directly
+            const auto* xs = sweep.XyzRow(0, r);
+            const auto* ys = sweep.XyzRow(1, r);
+            const auto* zs = sweep.XyzRow(2, r);
+            const auto* intens = sweep.intensity.ptr<uint16_t>(r);
+            for (int c = 0; c < size.width; ++c) {
+              auto& pt = cloud.at(c, r);
+              if (std::isnan(xs[c])) {
+                pt.x = pt.y = pt.z = pt.intensity = kNaNF;
+                continue;
+              }
+              const Vector3f pt_s{xs[c], ys[c], zs[c]};
+              const int tc = sweep.PoseCol(c, r);
+              pt.getVector3fMap() = sweep.TransformAt(tc, pt_s);
+              pt.intensity = intens[c];
+            }
+            continue;
+          }
+
+          if (sweep.layout == ScanLayout::kCompact) {
+            // Fast path, reconstruct xyz from range along beam directions
+            const auto* ranges = sweep.range.ptr<uint16_t>(r);
+            const auto* intens = sweep.intensity.ptr<uint16_t>(r);
+            const auto scale = static_cast<float>(sweep.scale);
+            for (int c = 0; c < size.width; ++c) {
+              auto& pt = cloud.at(c, r);
+              if (ranges[c] == 0) {
+                pt.x = pt.y = pt.z = pt.intensity = kNaNF;
+                continue;
+              }
+              const Vector3f pt_s =
+                  sweep.BeamAt({c, r}) * (ranges[c] / scale);
+              const int tc = sweep.PoseCol(c, r);
+              pt.getVector3fMap() = sweep.TransformAt(tc, pt_s);
+              pt.intensity = intens[c];
+            }
+            continue;
+          }
+
           for (int c = 0; c < size.width; ++c) {
             auto& pt = cloud.at(c, r);
 
@@ -62,7 +104,8 @@ void Sweep2Cloud(const LidarSweep& sweep,
               continue;
             }
 
-            pt.getVector3fMap() = sweep.TfAt(c) * pixel.Vec3fMap();
+            const int tc = sweep.PoseCol(c, r);
+            pt.getVector3fMap() = sweep.TransformAt(tc, pixel.Vec3fMap());
             pt.intensity = pixel.intensity;
           }
         }
@@ -92,7 +135,9 @@ void Grid2Cloud(const SweepGrid& grid,
                             continue;
                           }
 
-                          pt.getVector3fMap() = grid.TfAt(c) * match.mc_g.mean;
+                          const int tc = grid.PoseCol({c, r});
+                          pt.getVector3fMap() =
+                              grid.TransformAt(tc, match.mc_g.mean);
                           pt.intensity = match.PanoOk() ? 1.0 : 0.5;
                         }
                       }
@@ -86,7 +86,7 @@ void Grid2Markers(const SweepGrid& grid,
         MeanCovar2Marker(pt_p, es.eigenvalues(), es.eigenvectors(), pano_mk);
 
         grid_mk.action = Marker::ADD;
-        const auto& tf = grid.TfAt(c);
+        const auto& tf = grid.TfAt(grid.PoseCol({c, r}));
         const auto pt_g = (tf * match.mc_g.mean).cast<double>().eval();
         auto grid_cov = match.mc_g.Covar();
         const auto R = tf.rotationMatrix();
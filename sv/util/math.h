@@ -56,37 +56,6 @@ struct SinCos {
 
 using SinCosF = SinCos<float>;
 
-/// @brief Polynomial approximation to asin
-template <typename T>
-T AsinApprox(T x) {
-  static_assert(std::is_floating_point_v<T>, "T must be floating point");
-
-  const T x2 = x * x;
-  return x * (1 + x2 * (1 / 6.0 + x2 * (3.0 / 40.0 + x2 * 5.0 / 112.0)));
-}
-
-/// @brief A faster atan2
-template <typename T>
-T Atan2Approx(T y, T x) {
-  static_assert(std::is_floating_point_v<T>, "T must be floating point");
-  // http://pubs.opengroup.org/onlinepubs/009695399/functions/atan2.html
-  // Volkan SALMA
-  static constexpr T kPi3_4 = M_PI_4 * 3;
-  static constexpr T kPi_4 = M_PI_4;
-
-  T r, angle;
-  T abs_y = fabs(y) + 1e-10;  // kludge to prevent 0/0 condition
-  if (x < 0.0) {
-    r = (x + abs_y) / (abs_y - x);
-    angle = kPi3_4;
-  } else {
-    r = (x - abs_y) / (x + abs_y);
-    angle = kPi_4;
-  }
-  angle += (0.1963 * r * r - 0.9817) * r;
-  return y < 0.0 ? -angle : angle;
-}
-
 /// @struct Running mean and variance
 template <typename T, int N>
 struct MeanVar {
@@ -154,6 +123,130 @@ struct MeanCovar {
 using MeanCovar3f = MeanCovar<float, 3>;
 using MeanCovar3d = MeanCovar<double, 3>;
 
+/// @struct Raw moments (n, sum x, sum xx') of 3d points for computing the same
+/// mean and covariance as MeanCovar, without a division per point. Points are
+/// added kLanes at a time, with one lane per point so that all moments are
+/// vectorized. Points are shifted by the first one to keep the sums small
+/// (cell or window extent) which keeps float precision, see Finalize()
+template <typename T>
+struct MomentSum3 {
+  static constexpr int kLanes = 8;
+  using Lanes = Eigen::Array<T, kLanes, 1>;
+  using Vector = Eigen::Matrix<T, 3, 1>;
+  using Matrix = Eigen::Matrix<T, 3, 3>;
+
+  Vector ref{Vector::Zero()};  // shift, first point added
+  bool has_ref{false};
+  Lanes n{Lanes::Zero()};
+  Lanes x{Lanes::Zero()}, y{Lanes::Zero()}, z{Lanes::Zero()};
+  Lanes xx{Lanes::Zero()}, xy{Lanes::Zero()}, xz{Lanes::Zero()};
+  Lanes yy{Lanes::Zero()}, yz{Lanes::Zero()}, zz{Lanes::Zero()};
+
+  /// Points added by Add() that do not fill all lanes yet
+  int num_pending{0};
+  Lanes px{Lanes::Zero()}, py{Lanes::Zero()}, pz{Lanes::Zero()};
+
+  /// @brief Add one point, accumulated once kLanes points are pending
+  void Add(const Vector& pt) {
+    if (!has_ref) SetRef(pt);
+    px[num_pending] = pt.x();
+    py[num_pending] = pt.y();
+    pz[num_pending] = pt.z();
+    if (++num_pending == kLanes) Flush();
+  }
+
+  /// @brief Add num points, point i is (xs[i * stride], ys[i * stride],
+  /// zs[i * stride]) and is skipped if x is nan, e.g. (p, p + 1, p + 2, 4) for
+  /// packed xyzr pixels or one row of each plane with stride 1
+  void Add(const T* xs, const T* ys, const T* zs, int stride, int num) {
+    int i = 0;
+    if (!has_ref) {
+      // First valid point becomes the reference
+      for (; i < num && std::isnan(xs[i * stride]); ++i) {
+      }
+      if (i == num) return;
+      SetRef({xs[i * stride], ys[i * stride], zs[i * stride]});
+    }
+
+    for (; i + kLanes <= num; i += kLanes) {
+      Lanes bx, by, bz;
+      for (int k = 0; k < kLanes; ++k) {
+        const int j = (i + k) * stride;
+        bx[k] = xs[j];
+        by[k] = ys[j];
+        bz[k] = zs[j];
+      }
+      AddLanes(bx, by, bz, (bx == bx).template cast<T>());  // nan != nan
+    }
+    for (; i < num; ++i) {
+      const int j = i * stride;
+      if (!std::isnan(xs[j])) Add({xs[j], ys[j], zs[j]});
+    }
+  }
+
+  /// @brief Add a batch of kLanes points, mask is 1 for valid points else 0
+  void AddLanes(const Lanes& bx,
+                const Lanes& by,
+                const Lanes& bz,
+                const Lanes& mask) {
+    // select() so that a nan point contributes 0 instead of nan
+    const Lanes dx = (mask > 0).select(bx - ref.x(), Lanes::Zero());
+    const Lanes dy = (mask > 0).select(by - ref.y(), Lanes::Zero());
+    const Lanes dz = (mask > 0).select(bz - ref.z(), Lanes::Zero());
+    n += mask;
+    x += dx;
+    y += dy;
+    z += dz;
+    xx += dx * dx;
+    xy += dx * dy;
+    xz += dx * dz;
+    yy += dy * dy;
+    yz += dy * dz;
+    zz += dz * dz;
+  }
+
+  /// @brief Accumulate pending points
+  void Flush() {
+    if (num_pending == 0) return;
+    const Lanes mask =
+        (Lanes::LinSpaced(0, kLanes - 1) < T(num_pending)).template cast<T>();
+    AddLanes(px, py, pz, mask);
+    num_pending = 0;
+  }
+
+  /// @brief Total number of points, including pending ones
+  int count() const noexcept {
+    return static_cast<int>(n.sum()) + num_pending;
+  }
+
+  /// @brief Compute mean and covariance into mc, centering happens here once
+  /// instead of per point. Flushes pending points.
+  void Finalize(MeanCovar<T, 3>& mc) {
+    Flush();
+    mc.Reset();
+    mc.n = static_cast<int>(n.sum());
+    if (mc.n == 0) return;
+
+    const Vector s{x.sum(), y.sum(), z.sum()};
+    Matrix ss;
+    ss << xx.sum(), xy.sum(), xz.sum(),  //
+        xy.sum(), yy.sum(), yz.sum(),    //
+        xz.sum(), yz.sum(), zz.sum();
+    const Vector mean = s / mc.n;
+    mc.mean = ref + mean;
+    mc.covar_sum_ = ss - mean * s.transpose();
+  }
+
+  void Reset() { *this = MomentSum3{}; }
+  void SetRef(const Vector& pt) {
+    ref = pt;
+    has_ref = true;
+  }
+};
+
+using MomentSum3f = MomentSum3<float>;
+using MomentSum3d = MomentSum3<double>;
+
 /// @brief force the axis to be right handed for 3D
 /// @details sometimes eigvecs has det -1 (reflection), this makes it a rotation
 /// @ref
@@ -70,6 +70,75 @@ TEST(MathTest, TestMeanCovar) {
   }
 }
 
+/// @brief Expect mc is close to reference with relative tolerance
+void ExpectCloseMeanCovar(const MeanCovar3f& mc,
+                          const MeanCovar3d& ref,
+                          double tol) {
+  EXPECT_EQ(mc.n, ref.n);
+  const Eigen::Matrix3d cov = mc.Covar().cast<double>();
+  EXPECT_LE((cov - ref.Covar()).norm(), tol * ref.Covar().norm());
+  const Eigen::Vector3d mean = mc.mean.cast<double>();
+  EXPECT_LE((mean - ref.mean).norm(), tol * ref.mean.norm());
+}
+
+TEST(MathTest, TestMomentSum) {
+  for (int i = 3; i < 50; i += 10) {
+    const auto X = Eigen::Matrix3Xd::Random(3, i).eval();
+    MeanCovar3d ref;
+    for (int j = 0; j < X.cols(); ++j) ref.Add(X.col(j));
+
+    // One point at a time
+    MomentSum3f ms;
+    for (int j = 0; j < X.cols(); ++j) ms.Add(X.col(j).cast<float>());
+    EXPECT_EQ(ms.count(), i);
+    MeanCovar3f mc;
+    ms.Finalize(mc);
+    ExpectCloseMeanCovar(mc, ref, 1e-5);
+
+    // Strided xyz with a nan point in the middle, which is skipped
+    const int k = i / 2;
+    Eigen::Matrix4Xf P = Eigen::Matrix4Xf::Zero(4, i + 1);
+    P.topLeftCorner(3, k) = X.leftCols(k).cast<float>();
+    P.col(k).setConstant(kNaNF);
+    P.topRightCorner(3, i - k) = X.rightCols(i - k).cast<float>();
+    MomentSum3f ms2;
+    ms2.Add(P.data(), P.data() + 1, P.data() + 2, 4, i + 1);
+    MeanCovar3f mc2;
+    ms2.Finalize(mc2);
+    ExpectCloseMeanCovar(mc2, ref, 1e-5);
+  }
+}
+
+TEST(MathTest, TestMomentSumPrecision) {
+  // A small cell far away from origin, raw sums in float would lose most
+  // digits without shifting
+  for (const float offset : {10.0F, 100.0F, 1000.0F}) {
+    const Eigen::Vector3f center = Eigen::Vector3f::Constant(offset);
+    const Eigen::Matrix3Xf X =
+        (Eigen::Matrix3Xf::Random(3, 32) * 0.05F).colwise() + center;
+
+    // Reference from the same float points, so only accumulation error counts
+    MeanCovar3d ref;
+    MeanCovar3f welford;
+    MomentSum3f ms;
+    for (int j = 0; j < X.cols(); ++j) {
+      ref.Add(X.col(j).cast<double>());
+      welford.Add(X.col(j));
+      ms.Add(X.col(j));
+    }
+    MeanCovar3f mc;
+    ms.Finalize(mc);
+
+    // At least as precise as Welford in float
+    const auto err = [&](const MeanCovar3f& m) {
+      return (m.Covar().cast<double>() - ref.Covar()).norm() /
+             ref.Covar().norm();
+    };
+    EXPECT_LE(err(mc), std::max(err(welford), 1e-3)) << offset;
+    ExpectCloseMeanCovar(mc, ref, 1e-3);
+  }
+}
+
 TEST(MathTest, TestWrapCols) {
   EXPECT_EQ(WrapCols(0 - 64, 64), 0);
   EXPECT_EQ(WrapCols(1 - 64, 64), 1);
@@ -114,4 +183,18 @@ void BM_MeanCovar3d(benchmark::State& state) {
 }
 BENCHMARK(BM_MeanCovar3d)->Range(8, 512);
 
+void BM_MomentSum3f(benchmark::State& state) {
+  const auto X = Eigen::Matrix3Xf::Random(3, state.range(0)).eval();
+
+  for (auto _ : state) {
+    MomentSum3f ms;
+    ms.Add(X.data(), X.data() + 1, X.data() + 2, 3, static_cast<int>(X.cols()));
+    MeanCovar3f mc;
+    ms.Finalize(mc);
+    const auto cov = mc.Covar();
+    benchmark::DoNotOptimize(cov);
+  }
+}
+BENCHMARK(BM_MomentSum3f)->Range(8, 512);
+
 }  // namespace sv